@@ -2,6 +2,13 @@
 
 #include <sstream>
 #include <limits>
+#include <ostream>
+#include <iterator>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <cassert>
+#include <type_traits>
 
 static const auto THOUSAND = 1000;
 static const auto MILLION = THOUSAND*THOUSAND;
@@ -9,6 +16,9 @@ static const auto MAX_CONS_CELLS = 10*MILLION;
 
 static const auto PROGRAM_TIME = 3072 * THOUSAND;
 
+// Control stack entries allocated the first time one is pushed.
+static const size_t MIN_FRAMES = 256;
+
 namespace insn {
   using namespace aiproc;
   Instruction ldc(int32_t val) {
@@ -124,7 +134,30 @@ namespace insn {
   Instruction cdr() {
     return [](State* state) {
       auto val = boost::get<Pair::ptr>(state->data_stack.back());
-      state->data_stack.back() = val->cdr;
+      state->data_stack.back() = Pair::tail(val);
+    };
+  }
+
+  // A run of count cdrs, as one instruction. The walk holds no
+  // references until the end, and steps along a CDR-coded list by
+  // pointer.
+  Instruction cdr_chain(int32_t count) {
+    return [count](State* state) {
+      auto& top = state->data_stack.back();
+      auto owner = &boost::get<Pair::ptr>(top);
+      auto cell = owner->get();
+      for(int32_t i = 1; i < count; i++) {
+	if(cell->cdr_coded) {
+	  cell++;
+	} else {
+	  owner = &boost::get<Pair::ptr>(cell->cdr);
+	  cell = owner->get();
+	}
+      }
+      Value result = cell->cdr_coded ? Value(Pair::ptr(*owner, cell + 1)) : cell->cdr;
+      top = std::move(result);
+      state->program += count;
+      state->fused_insns += count - 1;
     };
   }
 
@@ -132,16 +165,17 @@ namespace insn {
     return [t, f](State* state) {
       auto cond = boost::get<int32_t>(state->data_stack.back());
       state->data_stack.pop_back();
-      state->control_stack.push_back(state->program+1);
+      state->push_frame(FRAME_JOIN, state->program+1, Environment::ptr());
       state->program = cond ? t : f;
     };
   }
 
   Instruction join() {
     return [](State* state) {
-      auto addr = boost::get<counter>(state->control_stack.back());
-      state->control_stack.pop_back();
-      state->program = addr;
+      auto &frame = state->pop_frame();
+      if(frame.kind != FRAME_JOIN)
+	throw std::runtime_error("Control Mismatch");
+      state->program = frame.address;
     };
   }
 
@@ -160,29 +194,29 @@ namespace insn {
       state->data_stack.pop_back();
       std::vector<Value> args(arg_count);
       for(int32_t i = arg_count; i ; i--) {
-	args[i-1] = state->data_stack.back();
+	args[i-1] = std::move(state->data_stack.back());
 	state->data_stack.pop_back();
       }
-      auto env = Environment::create(args, fn.environ);
-      state->control_stack.push_back(state->environment);
-      state->control_stack.push_back(state->program+1);
-      state->environment = env;
+      auto env = Environment::create(state, std::move(args), fn.environ);
+      state->push_frame(FRAME_RET, state->program+1, std::move(state->environment));
+      state->environment = std::move(env);
       state->program = fn.address;
     };
   }
 
   Instruction rtn() {
     return [](State* state) {
-      state->program = boost::get<counter>(state->control_stack.back());
-      state->control_stack.pop_back();
-      state->environment = boost::get<Environment::ptr>(state->control_stack.back());
-      state->control_stack.pop_back();
+      auto &frame = state->pop_frame();
+      if(frame.kind == FRAME_JOIN)
+	throw std::runtime_error("Control Mismatch");
+      state->program = frame.address;
+      state->environment = std::move(frame.environment);
     };
   }
 
   Instruction dum(int32_t size) {
     return [size](State* state) {
-      auto env = Environment::create(std::vector<Value>(), state->environment);
+      auto env = Environment::create(state, std::vector<Value>(), state->environment);
       env->values.resize(size);
       state->environment = env;
     };
@@ -200,8 +234,7 @@ namespace insn {
 	state->environment->values[i-1] = state->data_stack.back();
 	state->data_stack.pop_back();
       }
-      state->control_stack.push_back(state->environment->parent);
-      state->control_stack.push_back(state->program+1);
+      state->push_frame(FRAME_RET, state->program+1, state->environment->parent);
       state->program = fn.address;
     };
   }
@@ -218,25 +251,28 @@ namespace insn {
     return [arg_count](State* state) {
       auto fn = boost::get<Closure>(state->data_stack.back());
       state->data_stack.pop_back();
-      std::vector<Value> args(arg_count);
-      for(int32_t i = arg_count; i; i--) {
-	args[i-1] = state->data_stack.back();
-	state->data_stack.pop_back();
-      }
-      auto env = state->environment;
-      bool need_env = false;
-      while(env) {
-	if(env == fn.environ) {
-	  need_env = true;
-	  break;
+      auto &env = state->environment;
+      // The current frame may be recycled when the environment register
+      // is its only owner: no closure has captured it, no caller holds it
+      // on the control stack and the callee's scope doesn't contain it.
+      // Any of those would show up as an extra reference, so this is a
+      // constant time check rather than a walk up the scope chain.
+      if(env.use_count() == 1) {
+	env->values.resize(arg_count);
+	for(int32_t i = arg_count; i; i--) {
+	  env->values[i-1] = std::move(state->data_stack.back());
+	  state->data_stack.pop_back();
 	}
-	env = env->parent;
-      }
-      if(need_env) {
-	state->environment = Environment::create(args, fn.environ);
+	env->parent = std::move(fn.environ);
       } else {
-	state->environment->values = args;
+	std::vector<Value> args(arg_count);
+	for(int32_t i = arg_count; i; i--) {
+	  args[i-1] = std::move(state->data_stack.back());
+	  state->data_stack.pop_back();
+	}
+	env = Environment::create(state, std::move(args), std::move(fn.environ));
       }
+      state->program = fn.address;
     };
   }
 
@@ -276,20 +312,23 @@ namespace insn {
     return [](State* state) {
       auto val = boost::get<int32_t>(state->data_stack.back());
       state->data_stack.pop_back();
-      std::cout << val << std::endl;
+      if(state->log)
+	*state->log << "Lambda-Man debug " << val << std::endl;
     };
   }
 
-  Instruction parse(std::string line) {
+  Instruction parse(std::string line, Op& decoded) {
     using namespace std;
     stringstream liness(line);
     vector<string> tokens;
     copy(istream_iterator<string>(liness),
 	 istream_iterator<string>(),
 	 back_inserter<vector<string>>(tokens));
+    if(tokens.empty())
+      throw std::runtime_error("Empty instruction");
 
     string opcode = tokens[0];
-    int arg0, arg1;
+    int arg0 = 0, arg1 = 0;
     if(tokens.size() > 1)
       arg0 = atoi(tokens[1].c_str());
     if(tokens.size() > 2)
@@ -298,9 +337,12 @@ namespace insn {
     std::transform(opcode.begin(), opcode.end(), opcode.begin(), ::tolower);
 
 
-#define OPCODE0(op) if(opcode == #op) return op(); else
-#define OPCODE1(op) if(opcode == #op) return op(arg0); else
-#define OPCODE2(op) if(opcode == #op) return op(arg0, arg1); else
+    decoded.arg0 = arg0;
+    decoded.arg1 = arg1;
+
+#define OPCODE0(op) if(opcode == #op) { decoded.opcode = Opcode::op; return op(); } else
+#define OPCODE1(op) if(opcode == #op) { decoded.opcode = Opcode::op; return op(arg0); } else
+#define OPCODE2(op) if(opcode == #op) { decoded.opcode = Opcode::op; return op(arg0, arg1); } else
 
     OPCODE1(ldc)
     OPCODE2(ld)
@@ -331,29 +373,191 @@ namespace insn {
   }
 }
 
+namespace {
+  using namespace aiproc;
+
+  // Values waiting to be freed by the outermost release() on this
+  // thread, and whether one is running. The queue keeps its capacity,
+  // so freeing doesn't allocate.
+  thread_local std::vector<Value> release_queue;
+  thread_local bool releasing = false;
+
+  void defer(std::vector<Value>& queue, Environment::ptr& env) {
+    if(env.use_count() == 1)
+      queue.push_back(std::move(env));
+  }
+
+  // Take v for freeing later if this is its last reference.
+  void defer(std::vector<Value>& queue, Value& v) {
+    switch(v.which()) {
+    case 1:
+      defer(queue, boost::get<Closure>(v).environ);
+      break;
+    case 2: {
+      auto& pair = boost::get<Pair::ptr>(v);
+      if(pair.use_count() == 1)
+	queue.push_back(std::move(pair));
+      break;
+    }
+    case 3:
+      defer(queue, boost::get<Environment::ptr>(v));
+      break;
+    }
+  }
+
+  // The storage behind a list or tuple built in one go. A few cells fit
+  // in the block itself, so a tuple is a single allocation; longer lists
+  // get an array of their own.
+  struct ListBlock {
+    static const size_t INLINE_CELLS = 4;
+    Pair* cells;
+    size_t count = 0;
+    std::aligned_storage<sizeof(Pair), alignof(Pair)>::type storage[INLINE_CELLS];
+
+    explicit ListBlock(size_t size)
+      : cells(size <= INLINE_CELLS ? reinterpret_cast<Pair*>(storage)
+	      : static_cast<Pair*>(::operator new(sizeof(Pair) * size))) {}
+
+    ~ListBlock() {
+      while(count)
+	cells[--count].~Pair();
+      if(cells != reinterpret_cast<Pair*>(storage))
+	::operator delete(cells);
+    }
+  };
+
+  // The instruction allocating a cell or frame now, for the heap
+  // census; HOST_SITE when the host builds it outside any run.
+  uint32_t allocation_site(const State* state) {
+    return state->frame_count ? uint32_t(state->program) : HOST_SITE;
+  }
+
+  // Run from a destructor, to take the children only it refers to. If
+  // this is the outermost destructor running, free them one at a time
+  // from a queue, along with everything their own destructors queue;
+  // otherwise leave them on the outermost one's queue.
+  template <typename F>
+  void release(F take_children) {
+    take_children(release_queue);
+    if(releasing || release_queue.empty())
+      return;
+    releasing = true;
+    while(!release_queue.empty()) {
+      auto last = std::move(release_queue.back());
+      release_queue.pop_back();
+    }
+    releasing = false;
+  }
+}
+
 namespace aiproc {
   Pair::ptr Pair::create(State* state, Value car, Value cdr) {
-    return ptr(new Pair(state, car, cdr));
+    return std::make_shared<Pair>(Key(), state, std::move(car), std::move(cdr));
+  }
+
+  template <typename It>
+  Pair::ptr Pair::block(State* state, It first, size_t count, Value tail) {
+    auto block = std::make_shared<ListBlock>(count);
+    for(; block->count < count; ++first) {
+      auto cell = new(block->cells + block->count) Pair(Key(), state, *first, 0);
+      block->count++;
+      cell->cdr_coded = true;
+    }
+    auto& last = block->cells[count - 1];
+    last.cdr_coded = false;
+    last.cdr = std::move(tail);
+    return ptr(block, block->cells);
   }
 
-  Pair::Pair(State* state, Value car, Value cdr) : state(state), car(car), cdr(cdr) {
+  Value Pair::list(State* state, std::vector<Value> items) {
+    if(items.empty())
+      return 0;
+    return block(state, std::make_move_iterator(items.begin()), items.size(), 0);
+  }
+
+  Value Pair::tuple(State* state, std::initializer_list<Value> items) {
+    assert(items.size() >= 2);
+    return block(state, items.begin(), items.size() - 1, *(items.end() - 1));
+  }
+
+  Value Pair::tail(const ptr& self) {
+    if(self->cdr_coded)
+      return ptr(self, self.get() + 1);
+    return self->cdr;
+  }
+
+  Pair::Pair(Key, State* state, Value car, Value cdr)
+    : car(std::move(car)), cdr(std::move(cdr)), site(allocation_site(state)), state(state) {
     state->cell_count++;
+    state->stats.allocations++;
+    if(state->cell_count > state->stats.peak_cells)
+      state->stats.peak_cells = state->cell_count;
     if(state->cell_count > MAX_CONS_CELLS)
       throw std::runtime_error("WOAH. DUDE. Cool your jets.");
+    if(state->heap)
+      state->heap->pairs.insert(this);
   }
 
   Pair::~Pair() {
-    state->cell_count--;
+    if(state) {
+      state->cell_count--;
+      if(state->heap)
+	state->heap->pairs.erase(this);
+    }
+    release([this](std::vector<Value>& queue) {
+	defer(queue, car);
+	defer(queue, cdr);
+      });
+  }
+
+  Environment::ptr Environment::create(State* state, std::vector<Value> values, ptr parent) {
+    return std::make_shared<Environment>(Key(), state, std::move(values), std::move(parent));
   }
 
-  Environment::ptr Environment::create(std::vector<Value> values, ptr parent) {
-    return ptr(new Environment(values, parent));
+  Environment::Environment(Key, State* state, std::vector<Value> values, ptr parent)
+    : values(std::move(values)), parent(std::move(parent)), site(allocation_site(state)), state(state) {
+    if(state->heap)
+      state->heap->environments.insert(this);
   }
 
-  Environment::Environment(std::vector<Value> values, ptr parent)
-    : values(values), parent(parent) {}
+  Environment::~Environment() {
+    if(state && state->heap)
+      state->heap->environments.erase(this);
+    release([this](std::vector<Value>& queue) {
+	for(auto& v : values)
+	  defer(queue, v);
+	defer(queue, parent);
+      });
+  }
 
-  Pair::ptr State::run(Closure start, std::vector<Value> args) {
+  HeapRegistry::~HeapRegistry() {
+    for(auto pair : pairs)
+      pair->state = nullptr;
+    for(auto env : environments)
+      env->state = nullptr;
+  }
+
+  void State::push_frame(FrameKind kind, counter address, Environment::ptr env) {
+    if(frame_count == control_stack.size()) {
+      if(frame_count >= max_frames)
+	throw std::runtime_error("Control stack overflow!");
+      control_stack.resize(std::min(max_frames, std::max(MIN_FRAMES, 2 * frame_count)));
+    }
+    auto &frame = control_stack[frame_count++];
+    frame.kind = kind;
+    frame.address = address;
+    frame.environment = std::move(env);
+  }
+
+  Frame& State::pop_frame() {
+    if(!frame_count)
+      throw std::runtime_error("Control stack underflow!");
+    return control_stack[--frame_count];
+  }
+
+  State::State(Code code) : code(std::move(code)) {}
+
+  uint64_t State::enter(Closure start, std::vector<Value> args) {
     program = start.address;
 
     // We need to track the number of instructions so we can fail
@@ -361,48 +565,109 @@ namespace aiproc {
     // The rule is "1 minute if it's main, else 1 second), and main
     // is defined to be at address 0. So if we're calling address 0
     // we use 60 seconds, else we just use 1.
-    auto max_insns = program ? PROGRAM_TIME : 60 * PROGRAM_TIME;
-    decltype(max_insns) executed_insns = 0;
+    uint64_t max_insns = program ? PROGRAM_TIME : 60 * PROGRAM_TIME;
+
+    frame_count = 0;
+    environment = Environment::create(this, std::move(args), start.environ);
+    push_frame(FRAME_STOP, std::numeric_limits<counter>::max(), Environment::ptr());
+
+    started = std::chrono::steady_clock::now();
+    fused_insns = 0;
+    stats = RunStats();
+    stats.budget = max_insns;
+    stats.peak_cells = cell_count;
+    return max_insns;
+  }
+
+  Pair::ptr State::leave(uint64_t executed_insns) {
+    stats.instructions = executed_insns + fused_insns;
+    stats.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - started).count();
+
+    // Return value is whatever is on top of the stack.
+    auto result = boost::get<Pair::ptr>(data_stack.back());
+    data_stack.pop_back();
+    return result;
+  }
 
-    control_stack.push_back(Environment::ptr());
-    control_stack.push_back(std::numeric_limits<counter>::max());
-    environment = Environment::create(args, start.environ);
+  Pair::ptr State::run(Closure start, std::vector<Value> args) {
+    auto max_insns = enter(start, std::move(args));
+    decltype(max_insns) executed_insns = 0;
 
+    auto &insns = code->insns;
+    auto end = insns.size();
     for(;;) {
       auto pc = program;
-      code[pc](this);
+      if(pc >= end)
+	throw std::runtime_error("Ran off the end of the program!");
+      insns[pc](this);
       if(pc == program)
 	program++;
 
-      // If control is empty, we've returned from our entry point.
-      // It's time to stop execution.
-      if(control_stack.empty())
+      // If we've popped the stop frame, we've returned from our entry
+      // point. It's time to stop execution.
+      if(!frame_count)
 	break;
 
       // We're on a clock.
-      if(++executed_insns == max_insns)
+      if(++executed_insns + fused_insns >= max_insns)
 	throw std::runtime_error("Program took too long to execute!");
     };
 
-    // Return value is whatever is on top of the stack.
-    auto result = boost::get<Pair::ptr>(data_stack.back());
-    data_stack.pop_back();
-    return result;
+    // The loop stops before counting the rtn that got us out.
+    return leave(executed_insns + 1);
   };
 
-  State compile_program(std::string prog) {
-    State s;
+  uint64_t hash(const void *data, size_t length, uint64_t seed) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < length; i++) {
+      seed ^= bytes[i];
+      seed *= 1099511628211ULL;
+    }
+    return seed;
+  }
+
+  Code compile(std::string prog) {
     using namespace std;
+    auto code = make_shared<Program>();
+    code->hash = hash(prog.data(), prog.size());
     stringstream iss(prog);
-    vector<string> lines;
     while(!iss.eof()) {
       string line;
       getline(iss, line);
-      if(line.empty())
+      if(line.find_first_not_of(" \t\r") == string::npos)
 	continue;
-      s.code.push_back(insn::parse(line));
+      Op op;
+      code->insns.push_back(insn::parse(line, op));
+      code->ops.push_back(op);
+    }
+
+    // Every jump has to land on an instruction.
+    for(auto& op : code->ops) {
+      bool jumps = op.opcode == Opcode::sel || op.opcode == Opcode::tsel;
+      if(jumps || op.opcode == Opcode::ldf) {
+	for(auto target : {op.arg0, op.arg1}) {
+	  if(target < 0 || size_t(target) >= code->ops.size())
+	    throw runtime_error("Address out of range: " + to_string(target));
+	  if(!jumps)
+	    break;
+	}
+      }
     }
 
-    return s;
+    // Fuse runs of cdrs. Every position in a run gets the rest of it,
+    // so jumping into the middle still works.
+    size_t run = 0;
+    for(size_t i = code->ops.size(); i--; ) {
+      run = code->ops[i].opcode == Opcode::cdr ? run + 1 : 0;
+      if(run > 1)
+	code->insns[i] = insn::cdr_chain(run);
+    }
+
+    return code;
+  }
+
+  State compile_program(std::string prog) {
+    return State(compile(prog));
   }
 }
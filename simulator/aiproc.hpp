@@ -1,7 +1,13 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <vector>
 #include <functional>
+#include <iosfwd>
+#include <initializer_list>
+#include <memory>
+#include <unordered_set>
 #include <boost/variant.hpp>
 
 namespace aiproc {
@@ -16,6 +22,33 @@ namespace aiproc {
   using Instruction = std::function<void(State*)>;
   using counter = std::vector<Instruction>::size_type;
 
+  enum class Opcode : uint8_t {
+    ldc, ld, add, sub, mul, div, ceq, cgt, cgte, atom, cons, car, cdr,
+    sel, join, ldf, ap, rtn, dum, rap, tsel, tap, trap, st, debug
+  };
+
+  // An instruction as written, for interpreters that want to look at
+  // what they're running rather than just call it.
+  struct Op {
+    Opcode opcode;
+    int32_t arg0;
+    int32_t arg1;
+  };
+
+  // Compiled code is immutable, so every State running the same program
+  // can share one copy.
+  struct Program {
+    std::vector<Instruction> insns;
+    std::vector<Op> ops;
+    // Hash of the source, for keying anything derived from running it.
+    uint64_t hash = 0;
+  };
+  using Code = std::shared_ptr<const Program>;
+
+  // The allocation site of anything the simulator made rather than the
+  // program, such as the world state and the arguments to main.
+  const uint32_t HOST_SITE = UINT32_MAX;
+
   using Value = boost::variant<
     int32_t,
     boost::recursive_wrapper<Closure>,
@@ -24,30 +57,70 @@ namespace aiproc {
     Instruction,
     counter >;
 
+  // Dropping the last reference to a cell or frame never recurses into
+  // what it refers to, so a list or scope chain of any length can be
+  // freed without running out of C stack.
   struct Pair {
     using ptr = std::shared_ptr<Pair>;
     Value car;
     Value cdr;
+    // Set on every cell but the last of a list built by list(): the
+    // cdr is the next cell along rather than the cdr member.
+    bool cdr_coded = false;
+    // The counter of the instruction that allocated it, or HOST_SITE.
+    uint32_t site;
 
     static ptr create(State* state, Value car, Value cdr);
 
+    // A proper list of items, as one allocation. To car, cdr and atom
+    // its cells are ordinary pairs, but they take less memory than
+    // consing the list up and sit next to each other for walking.
+    static Value list(State* state, std::vector<Value> items);
+
+    // A tuple of two or more items, (a . (b . ... z)), laid out as list()
+    // lays out a list, with z as the last cdr.
+    static Value tuple(State* state, std::initializer_list<Value> items);
+
+    // The cdr of the cell self points to, however it's stored.
+    static Value tail(const ptr& self);
+
+    // Only create() can make a Key, so every cell is counted.
+    class Key {
+      friend struct Pair;
+      Key() {}
+    };
+    Pair(Key, State* state, Value car, Value cdr);
     ~Pair();
 
   private:
-    Pair(State* state, Value car, Value cdr);
-
+    friend struct HeapRegistry;
     State* state;
+
+    // count cells from first on, each CDR-coded to the next but the
+    // last, whose cdr is tail.
+    template <typename It>
+    static ptr block(State* state, It first, size_t count, Value tail);
   };
 
   struct Environment {
     using ptr = std::shared_ptr<Environment>;
     std::vector<Value> values;
     ptr parent;
+    // As for Pair.
+    uint32_t site;
+
+    static ptr create(State* state, std::vector<Value> values, ptr parent);
 
-    static ptr create(std::vector<Value> values, ptr parent);
-    
-  protected:
-    Environment(std::vector<Value> values, ptr parent);
+    class Key {
+      friend struct Environment;
+      Key() {}
+    };
+    Environment(Key, State* state, std::vector<Value> values, ptr parent);
+    ~Environment();
+
+  private:
+    friend struct HeapRegistry;
+    State* state;
   };
 
   struct Closure {
@@ -55,20 +128,89 @@ namespace aiproc {
     counter address;
   };
 
+  // Control stack entries are tagged as in the spec, so a mismatched
+  // join or rtn is caught rather than silently jumping somewhere odd.
+  enum FrameKind : uint8_t { FRAME_STOP = 0, FRAME_JOIN = 1, FRAME_RET = 2 };
+
+  struct Frame {
+    counter address;
+    Environment::ptr environment;
+    FrameKind kind;
+  };
+
+  // Every cell and frame a State has allocated and not yet freed, so a
+  // census can find the ones nothing but each other refers to. Kept only
+  // once asked for, by track_heap. Anything still registered when its
+  // State goes is cut loose from it rather than left pointing at it.
+  struct HeapRegistry {
+    std::unordered_set<Pair*> pairs;
+    std::unordered_set<Environment*> environments;
+
+    ~HeapRegistry();
+  };
+
+  // What a single call to State::run cost.
+  struct RunStats {
+    uint64_t instructions = 0;
+    // The instruction limit the call ran under.
+    uint64_t budget = 0;
+    // Cons cells allocated, and the most that were live at once.
+    uint64_t allocations = 0;
+    size_t peak_cells = 0;
+    uint64_t nanoseconds = 0;
+  };
+
   struct State {
     // Stacks and registers, as defined in the spec
-    std::vector<Instruction> code;
+    Code code;
     std::vector<Value> data_stack;
-    std::vector<Value> control_stack;
     counter program;
     Environment::ptr environment;
 
+    // Only the first frame_count entries of the control stack are live.
+    // It grows as calls nest, keeping its size from one run to the next,
+    // and nesting deeper than max_frames is a fault.
+    std::vector<Frame> control_stack;
+    size_t frame_count = 0;
+    size_t max_frames = 100 * 1000;
+
+    void push_frame(FrameKind kind, counter address, Environment::ptr env);
+    Frame& pop_frame();
+
     // The number of cons cells in this machine.
     // Only 10 million are allowed.
     size_t cell_count=0;    
 
+    // Filled in by every call to run.
+    RunStats stats;
+
+    // Where DEBUG writes its values; they're dropped if this is null.
+    std::ostream* log = nullptr;
+
+    // Null unless track_heap was called.
+    std::unique_ptr<HeapRegistry> heap;
+
+    // Instructions executed by fused instructions, beyond the one
+    // each is counted as by the loop that dispatched it.
+    uint64_t fused_insns = 0;
+
+    State() = default;
+    explicit State(Code code);
+
     Pair::ptr run(Closure start, std::vector<Value> args);
+
+  private:
+    // run is enter, instructions until the stop frame is popped, then
+    // leave; enter returns the instruction budget for the call.
+    uint64_t enter(Closure start, std::vector<Value> args);
+    Pair::ptr leave(uint64_t executed_insns);
+
+    std::chrono::steady_clock::time_point started;
   };
 
+  // 64-bit FNV-1a.
+  uint64_t hash(const void *data, size_t length, uint64_t seed = 14695981039346656037ULL);
+
+  Code compile(std::string);
   State compile_program(std::string);
 }
@@ -0,0 +1,209 @@
+/*
+ * Macrobenchmark: play whole games on generated maps over a grid of sizes,
+ * pill densities and ghost counts, and print a CSV row per game so that
+ * scaling shows up as curves.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <sys/resource.h>
+#include "world.hpp"
+#include "mapgen.hpp"
+
+using namespace std;
+using namespace LambdaWorld;
+
+// Heads for a pill on a square next to it if there is one, or else
+// follows the corridor it's in: ahead, right, left or back, whichever is
+// first open. It reads its squares out of the world on every step, so
+// it costs more on larger maps, and eats more on denser ones.
+static const char *lambda_man_prog =
+  // 0: main returns (0, step).
+  "LDC 0\nLDF 4\nCONS\nRTN\n"
+  // 4: step(state, world) is (state, look(map, x, y, direction)).
+  "LD 0 0\nLD 0 1\nCAR\n"
+  "LD 0 1\nCDR\nCAR\nCDR\nCAR\nCAR\n"
+  "LD 0 1\nCDR\nCAR\nCDR\nCAR\nCDR\n"
+  "LD 0 1\nCDR\nCAR\nCDR\nCDR\nCAR\n"
+  "LDF 29\nAP 4\nCONS\nRTN\n"
+  // 29: look(map, x, y, direction) passes the squares up, right, down
+  // and left of Lambda-Man on to decide.
+  "LD 0 0\nLD 0 1\nLD 0 2\nLDC 1\nSUB\nLDF 62\nAP 3\n"
+  "LD 0 0\nLD 0 1\nLDC 1\nADD\nLD 0 2\nLDF 62\nAP 3\n"
+  "LD 0 0\nLD 0 1\nLD 0 2\nLDC 1\nADD\nLDF 62\nAP 3\n"
+  "LD 0 0\nLD 0 1\nLDC 1\nSUB\nLD 0 2\nLDF 62\nAP 3\n"
+  "LD 0 3\nLDC 0\nLDF 84\nAP 6\nRTN\n"
+  // 62: cell(map, x, y).
+  "LD 0 0\nLD 0 2\nLDF 70\nAP 2\nLD 0 1\nLDF 70\nAP 2\nRTN\n"
+  // 70: nth(list, n), looping in its own frame.
+  "LD 0 1\nTSEL 72 81\n"
+  "LD 0 0\nCDR\nST 0 0\nLD 0 1\nLDC 1\nSUB\nST 0 1\nLDC 1\nTSEL 70 70\n"
+  "LD 0 0\nCAR\nRTN\n"
+  // 84: decide(up, right, down, left, direction, scratch): the first
+  // square with a pill or power pill...
+  "LD 0 0\nLDC 2\nCGTE\nLDC 3\nLD 0 0\nCGTE\nMUL\nTSEL 92 94\nLDC 0\nRTN\n"
+  "LD 0 1\nLDC 2\nCGTE\nLDC 3\nLD 0 1\nCGTE\nMUL\nTSEL 102 104\nLDC 1\nRTN\n"
+  "LD 0 2\nLDC 2\nCGTE\nLDC 3\nLD 0 2\nCGTE\nMUL\nTSEL 112 114\nLDC 2\nRTN\n"
+  "LD 0 3\nLDC 2\nCGTE\nLDC 3\nLD 0 3\nCGTE\nMUL\nTSEL 122 124\nLDC 3\nRTN\n"
+  // 124: ...or else the first way open of ahead, right and left...
+  "LD 0 4\nLDF 166\nAP 1\nST 0 5\nLD 0 5\nLDC 0\nCGTE\nTSEL 132 134\nLD 0 5\nRTN\n"
+  "LD 0 4\nLDC 1\nADD\nLDF 166\nAP 1\nST 0 5\nLD 0 5\nLDC 0\nCGTE\nTSEL 132 144\n"
+  "LD 0 4\nLDC 3\nADD\nLDF 166\nAP 1\nST 0 5\nLD 0 5\nLDC 0\nCGTE\nTSEL 132 154\n"
+  // 154: ...or else back.
+  "LD 0 4\nLDC 2\nADD\nST 0 5\nLD 0 5\nLD 0 5\nLDC 4\nDIV\nLDC 4\nMUL\nSUB\nRTN\n"
+  // 166: pick(d) is d mod 4 if that way is open, or -1.
+  "LD 0 0\nLD 0 0\nLDC 4\nDIV\nLDC 4\nMUL\nSUB\nST 0 0\n"
+  "LD 0 0\nLDF 182\nAP 1\nTSEL 178 180\nLD 0 0\nRTN\nLDC -1\nRTN\n"
+  // 182: at(d) is decide's square that way.
+  "LD 0 0\nLDC 0\nCEQ\nTSEL 186 188\nLD 2 0\nRTN\n"
+  "LD 0 0\nLDC 1\nCEQ\nTSEL 192 194\nLD 2 1\nRTN\n"
+  "LD 0 0\nLDC 2\nCEQ\nTSEL 198 200\nLD 2 2\nRTN\n"
+  "LD 2 3\nRTN\n";
+
+// Chases Lambda-Man: closes the gap across, then up or down. Left to
+// itself a ghost won't turn back, so this is enough to keep it moving.
+static const char *ghost_prog =
+  "int 1\nmov c,a\nmov d,b\n"
+  "int 3\nint 5\n"
+  "jlt 9,a,c\njgt 11,a,c\njlt 13,b,d\njeq 15,0,0\n"
+  "mov a,1\njeq 16,0,0\n"
+  "mov a,3\njeq 16,0,0\n"
+  "mov a,2\njeq 16,0,0\n"
+  "mov a,0\n"
+  "int 0\nhlt\n";
+
+template <typename T>
+static vector<T> parseList(const char *text)
+{
+    vector<T> values;
+    stringstream stream(text);
+    string item;
+    while (getline(stream, item, ',')) {
+        istringstream field(item);
+        T value;
+        if (!(field >> value)) {
+            throw runtime_error(string("Bad list: ") + text);
+        }
+        values.push_back(value);
+    }
+    return values;
+}
+
+static string readFile(const char *path)
+{
+    ifstream stream(path);
+    if (!stream) {
+        throw runtime_error(string("Can't read ") + path);
+    }
+    return string(istreambuf_iterator<char>(stream), istreambuf_iterator<char>());
+}
+
+// High-water mark of the whole process so far, in kilobytes, not of any
+// one game: it only grows. The grid runs from small maps to large ones,
+// so it still goes up with map size.
+static long processPeakRss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static const char *outcomeName(Outcome outcome)
+{
+    switch (outcome) {
+        case WON:
+            return "won";
+        case LOST:
+            return "lost";
+        case TIMED_OUT:
+            return "timed-out";
+        default:
+            return "running";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // --sizes a,b,...       square maps with these sides (up to 256)
+    // --densities a,b,...   fractions of open squares with pills
+    // --ghosts a,b,...      ghost counts
+    // --seeds <n>           games per combination, seeded 1 to n
+    // --program <file>      Lambda-Man program; the default eats what's
+    //                       next to it and otherwise follows corridors
+    // --ghost-program <file> program for every ghost; the default chases
+    // The default Lambda-Man reads the map on every step, which makes
+    // a game on a 128-square map take seconds; ask for those with --sizes.
+    vector<unsigned int> sizes = {16, 32, 64};
+    vector<double> densities = {0.5, 1.0};
+    vector<unsigned int> ghosts = {0, 4, 16, 64};
+    unsigned int seeds = 1;
+    string program = lambda_man_prog;
+    vector<string> ghostPrograms = {ghost_prog};
+    try {
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+                sizes = parseList<unsigned int>(argv[++i]);
+            } else if (strcmp(argv[i], "--densities") == 0 && i + 1 < argc) {
+                densities = parseList<double>(argv[++i]);
+            } else if (strcmp(argv[i], "--ghosts") == 0 && i + 1 < argc) {
+                ghosts = parseList<unsigned int>(argv[++i]);
+            } else if (strcmp(argv[i], "--seeds") == 0 && i + 1 < argc) {
+                seeds = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--program") == 0 && i + 1 < argc) {
+                program = readFile(argv[++i]);
+            } else if (strcmp(argv[i], "--ghost-program") == 0 && i + 1 < argc) {
+                ghostPrograms = {readFile(argv[++i])};
+            } else {
+                throw runtime_error(string("Unknown argument ") + argv[i]);
+            }
+        }
+    } catch (const exception &e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    cout << "width,height,pill_density,ghosts,seed,outcome,score,ticks,ai_calls,instructions,"
+         << "seconds,ticks_per_sec,instructions_per_sec,peak_cells,process_peak_rss_kb" << endl;
+    for (auto size : sizes) {
+        for (auto density : densities) {
+            for (auto ghostCount : ghosts) {
+                for (unsigned int seed = 1; seed <= seeds; ++seed) {
+                    MapSpec spec;
+                    spec.width = spec.height = size;
+                    spec.pill_density = density;
+                    spec.ghosts = ghostCount;
+                    spec.seed = seed;
+
+                    GameStats stats;
+                    stats.sampling = false;
+                    GameOptions options;
+                    options.stats = &stats;
+                    GameResult result;
+                    try {
+                        result = runWorld(generateMap(spec), program, ghostPrograms, options);
+                    } catch (const exception &e) {
+                        cerr << size << "x" << size << ", " << ghostCount << " ghosts, seed " << seed
+                             << ": " << e.what() << endl;
+                        continue;
+                    }
+
+                    double seconds = stats.nanoseconds / 1e9;
+                    cout << size << "," << size << "," << density << "," << ghostCount << "," << seed
+                         << "," << outcomeName(result.outcome) << "," << result.score << "," << result.ticks
+                         << "," << stats.calls << "," << stats.total.instructions
+                         << "," << seconds
+                         << "," << (seconds > 0 ? result.ticks / seconds : 0)
+                         << "," << (seconds > 0 ? stats.total.instructions / seconds : 0)
+                         << "," << stats.total.peak_cells
+                         << "," << processPeakRss() << endl;
+                }
+            }
+        }
+    }
+    return 0;
+}
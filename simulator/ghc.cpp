@@ -0,0 +1,177 @@
+#include "ghc.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+  using namespace ghc;
+
+  const size_t MAX_INSTRUCTIONS = 256;
+
+  struct Mnemonic {
+    const char* name;
+    Opcode opcode;
+    size_t args;
+  };
+
+  const Mnemonic MNEMONICS[] = {
+    {"mov", Opcode::mov, 2}, {"inc", Opcode::inc, 1}, {"dec", Opcode::dec, 1},
+    {"add", Opcode::add, 2}, {"sub", Opcode::sub, 2}, {"mul", Opcode::mul, 2},
+    {"div", Opcode::div, 2}, {"and", Opcode::and_, 2}, {"or", Opcode::or_, 2},
+    {"xor", Opcode::xor_, 2}, {"jlt", Opcode::jlt, 3}, {"jeq", Opcode::jeq, 3},
+    {"jgt", Opcode::jgt, 3}, {"int", Opcode::int_, 1}, {"hlt", Opcode::hlt, 0}
+  };
+
+  std::string trim(const std::string& s) {
+    auto begin = s.find_first_not_of(" \t\r");
+    if(begin == std::string::npos)
+      return "";
+    return s.substr(begin, s.find_last_not_of(" \t\r") - begin + 1);
+  }
+
+  uint8_t number(const std::string& text) {
+    if(text.empty() || !std::all_of(text.begin(), text.end(), ::isdigit))
+      throw std::runtime_error("Bad argument " + text);
+    auto value = std::stoul(text);
+    if(value > 255)
+      throw std::runtime_error("Constant out of range: " + text);
+    return uint8_t(value);
+  }
+
+  Arg parse_arg(std::string text) {
+    text = trim(text);
+    if(text == "pc")
+      return Arg{Mode::pc, 0};
+    if(text.size() == 1 && text[0] >= 'a' && text[0] <= 'h')
+      return Arg{Mode::reg, uint8_t(text[0] - 'a')};
+    if(text.size() > 2 && text.front() == '[' && text.back() == ']') {
+      auto inner = trim(text.substr(1, text.size() - 2));
+      if(inner.size() == 1 && inner[0] >= 'a' && inner[0] <= 'h')
+	return Arg{Mode::ind, uint8_t(inner[0] - 'a')};
+      return Arg{Mode::mem, number(inner)};
+    }
+    return Arg{Mode::imm, number(text)};
+  }
+
+  Op parse(const std::string& line) {
+    std::istringstream in(line);
+    std::string name;
+    in >> name;
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    auto mnemonic = std::find_if(std::begin(MNEMONICS), std::end(MNEMONICS),
+				 [&](const Mnemonic& m) { return name == m.name; });
+    if(mnemonic == std::end(MNEMONICS))
+      throw std::runtime_error("Unknown opcode: " + name);
+
+    std::string rest;
+    std::getline(in, rest);
+    std::transform(rest.begin(), rest.end(), rest.begin(), ::tolower);
+    std::vector<std::string> texts;
+    if(!trim(rest).empty()) {
+      std::istringstream fields(rest);
+      std::string field;
+      while(std::getline(fields, field, ','))
+	texts.push_back(field);
+    }
+    if(texts.size() != mnemonic->args)
+      throw std::runtime_error("Wrong number of arguments to " + name);
+
+    Op op;
+    op.opcode = mnemonic->opcode;
+    for(size_t i = 0; i < texts.size(); i++)
+      op.args[i] = parse_arg(texts[i]);
+
+    switch(op.opcode) {
+    case Opcode::jlt: case Opcode::jeq: case Opcode::jgt:
+    case Opcode::int_:
+      if(op.args[0].mode != Mode::imm)
+	throw std::runtime_error(name + " needs a constant first argument");
+      break;
+    case Opcode::hlt:
+      break;
+    default:
+      if(op.args[0].mode == Mode::imm || op.args[0].mode == Mode::pc)
+	throw std::runtime_error(name + " can't write to " + trim(texts[0]));
+      break;
+    }
+    return op;
+  }
+
+  uint8_t& location(Machine& m, const Arg& arg) {
+    switch(arg.mode) {
+    case Mode::reg: return m.reg[arg.value];
+    case Mode::ind: return m.data[m.reg[arg.value]];
+    default: return m.data[arg.value];
+    }
+  }
+
+  uint8_t read(Machine& m, const Arg& arg) {
+    switch(arg.mode) {
+    case Mode::imm: return arg.value;
+    case Mode::pc: return m.pc;
+    default: return location(m, arg);
+    }
+  }
+}
+
+namespace ghc {
+  bool run(Machine& m, const Interrupt& interrupt) {
+    auto& ops = m.code->ops;
+    m.pc = 0;
+    for(unsigned int cycle = 0; cycle < MAX_CYCLES; cycle++) {
+      if(m.pc >= ops.size())
+	return false;
+      auto pc = m.pc;
+      auto& op = ops[pc];
+      auto& a = op.args[0];
+      auto& b = op.args[1];
+      switch(op.opcode) {
+      case Opcode::mov: location(m, a) = read(m, b); break;
+      case Opcode::inc: location(m, a)++; break;
+      case Opcode::dec: location(m, a)--; break;
+      case Opcode::add: location(m, a) += read(m, b); break;
+      case Opcode::sub: location(m, a) -= read(m, b); break;
+      case Opcode::mul: location(m, a) *= read(m, b); break;
+      case Opcode::div: {
+	auto divisor = read(m, b);
+	if(!divisor)
+	  return false;
+	location(m, a) /= divisor;
+	break;
+      }
+      case Opcode::and_: location(m, a) &= read(m, b); break;
+      case Opcode::or_: location(m, a) |= read(m, b); break;
+      case Opcode::xor_: location(m, a) ^= read(m, b); break;
+      case Opcode::jlt: if(read(m, b) < read(m, op.args[2])) m.pc = a.value; break;
+      case Opcode::jeq: if(read(m, b) == read(m, op.args[2])) m.pc = a.value; break;
+      case Opcode::jgt: if(read(m, b) > read(m, op.args[2])) m.pc = a.value; break;
+      case Opcode::int_: interrupt(a.value, m); break;
+      case Opcode::hlt: return true;
+      }
+      if(m.pc == pc)
+	m.pc++;
+    }
+    return false;
+  }
+
+  Code compile(const std::string& source) {
+    auto code = std::make_shared<Program>();
+    std::istringstream in(source);
+    std::string line;
+    for(size_t line_number = 1; std::getline(in, line); line_number++) {
+      line = trim(line.substr(0, line.find(';')));
+      if(line.empty())
+	continue;
+      if(code->ops.size() == MAX_INSTRUCTIONS)
+	throw std::runtime_error("Ghost programs are limited to 256 instructions");
+      try {
+	code->ops.push_back(parse(line));
+      } catch(const std::exception& e) {
+	throw std::runtime_error("Ghost program line " + std::to_string(line_number) + ": " + e.what());
+      }
+    }
+    return code;
+  }
+}
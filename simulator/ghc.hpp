@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The ghost CPU: eight 8-bit registers a to h, a program counter and
+// 256 bytes of data memory, running programs of at most 256
+// instructions for at most MAX_CYCLES instructions a call.
+namespace ghc {
+  enum class Opcode : uint8_t {
+    mov, inc, dec, add, sub, mul, div, and_, or_, xor_, jlt, jeq, jgt, int_, hlt
+  };
+
+  // Register, [register], constant, [constant] or pc.
+  enum class Mode : uint8_t { reg, ind, imm, mem, pc };
+
+  struct Arg {
+    Mode mode;
+    uint8_t value;
+  };
+
+  struct Op {
+    Opcode opcode;
+    Arg args[3];
+  };
+
+  struct Program {
+    std::vector<Op> ops;
+  };
+  using Code = std::shared_ptr<const Program>;
+
+  // Registers and memory last from one run to the next; only the
+  // program counter starts again at 0.
+  struct Machine {
+    Code code;
+    uint8_t reg[8] = {};
+    uint8_t pc = 0;
+    uint8_t data[256] = {};
+
+    Machine() = default;
+    explicit Machine(Code code) : code(std::move(code)) {}
+  };
+
+  // Instructions a run may take before it's cut off.
+  const unsigned int MAX_CYCLES = 1024;
+
+  // Called for INT, with the interrupt number. Arguments and results
+  // are in the registers.
+  using Interrupt = std::function<void(uint8_t, Machine&)>;
+
+  // Run from the top until HLT. False if the program faulted, ran off
+  // the end of its code or ran out of cycles first; whatever it did
+  // through interrupts before then stands.
+  bool run(Machine& machine, const Interrupt& interrupt);
+
+  // Throws naming the line at fault.
+  Code compile(const std::string& source);
+}
@@ -0,0 +1,415 @@
+#include "heap.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+namespace {
+  using namespace aiproc;
+
+  const size_t NONE = std::numeric_limits<size_t>::max();
+
+  // In Opcode order.
+  const char* const OPCODE_NAMES[] = {
+    "LDC", "LD", "ADD", "SUB", "MUL", "DIV", "CEQ", "CGT", "CGTE", "ATOM", "CONS", "CAR", "CDR",
+    "SEL", "JOIN", "LDF", "AP", "RTN", "DUM", "RAP", "TSEL", "TAP", "TRAP", "ST", "DEBUG"
+  };
+
+  const char* kind_name(HeapKind kind) {
+    switch(kind) {
+    case HeapKind::pair: return "pair";
+    case HeapKind::environment: return "environment";
+    default: return "closure";
+    }
+  }
+
+  struct Node {
+    const void* object;
+    HeapKind kind;
+  };
+
+  // The cells and frames of one heap, numbered, with the references
+  // between them.
+  class Graph {
+  public:
+    std::vector<Node> nodes;
+
+    size_t add(const Pair* pair) {
+      return add(pair, HeapKind::pair);
+    }
+
+    size_t add(const Environment* env) {
+      return add(env, HeapKind::environment);
+    }
+
+    const Pair& pair(size_t id) const {
+      return *static_cast<const Pair*>(nodes[id].object);
+    }
+
+    const Environment& environment(size_t id) const {
+      return *static_cast<const Environment*>(nodes[id].object);
+    }
+
+    uint32_t site(size_t id) const {
+      return nodes[id].kind == HeapKind::pair ? pair(id).site : environment(id).site;
+    }
+
+    uint64_t bytes(size_t id) const {
+      if(nodes[id].kind == HeapKind::pair)
+	return sizeof(Pair);
+      return sizeof(Environment) + environment(id).values.capacity() * sizeof(Value);
+    }
+
+    // The node v refers to, adding it if it's new, or NONE.
+    size_t target(const Value& v) {
+      switch(v.which()) {
+      case 1: {
+	auto& env = boost::get<Closure>(v).environ;
+	return env ? add(env.get()) : NONE;
+      }
+      case 2:
+	return add(boost::get<Pair::ptr>(v).get());
+      case 3: {
+	auto& env = boost::get<Environment::ptr>(v);
+	return env ? add(env.get()) : NONE;
+      }
+      default:
+	return NONE;
+      }
+    }
+
+    // Call f with every node id refers to.
+    template <typename F>
+    void each_child(size_t id, F f) {
+      auto visit = [&](size_t child) {
+	if(child != NONE)
+	  f(child);
+      };
+      if(nodes[id].kind == HeapKind::pair) {
+	auto& cell = pair(id);
+	visit(target(cell.car));
+	visit(cell.cdr_coded ? add(&cell + 1) : target(cell.cdr));
+      } else {
+	auto& env = environment(id);
+	for(auto& v : env.values)
+	  visit(target(v));
+	if(env.parent)
+	  visit(add(env.parent.get()));
+      }
+    }
+
+    // Call f with every value id holds, for finding closures.
+    template <typename F>
+    void each_value(size_t id, F f) const {
+      if(nodes[id].kind == HeapKind::pair) {
+	f(pair(id).car);
+	if(!pair(id).cdr_coded)
+	  f(pair(id).cdr);
+      } else {
+	for(auto& v : environment(id).values)
+	  f(v);
+      }
+    }
+
+  private:
+    size_t add(const void* object, HeapKind kind) {
+      auto found = index.emplace(object, nodes.size());
+      if(found.second)
+	nodes.push_back(Node{object, kind});
+      return found.first->second;
+    }
+
+    std::unordered_map<const void*, size_t> index;
+  };
+
+  // Strongly connected components of a graph given as each node's
+  // edges, edges[starts[v]] up to edges[starts[v+1]]. Tarjan's
+  // algorithm, with an explicit stack so long chains don't use up the
+  // C stack. A component's successors get lower numbers than it does.
+  class Components {
+  public:
+    std::vector<size_t> component;
+    // Whether each component is a cycle: more than one node, or one
+    // that refers to itself.
+    std::vector<bool> cyclic;
+
+    Components(const std::vector<size_t>& starts, const std::vector<size_t>& edges)
+      : component(starts.size() - 1, NONE), starts(starts), edges(edges),
+	order(starts.size() - 1, NONE), low(starts.size() - 1), on_stack(starts.size() - 1, false) {
+      for(size_t root = 0; root < order.size(); root++) {
+	if(order[root] != NONE)
+	  continue;
+	visit(root);
+	while(!calls.empty()) {
+	  auto v = calls.back().first;
+	  auto& next = calls.back().second;
+	  if(next < starts[v + 1]) {
+	    auto w = edges[next++];
+	    if(w == v)
+	      self_loops.push_back(v);
+	    if(order[w] == NONE)
+	      visit(w);
+	    else if(on_stack[w])
+	      low[v] = std::min(low[v], order[w]);
+	    continue;
+	  }
+	  calls.pop_back();
+	  if(!calls.empty())
+	    low[calls.back().first] = std::min(low[calls.back().first], low[v]);
+	  if(low[v] == order[v])
+	    pop_component(v);
+	}
+      }
+      for(auto v : self_loops)
+	cyclic[component[v]] = true;
+    }
+
+  private:
+    void visit(size_t v) {
+      order[v] = low[v] = next_order++;
+      stack.push_back(v);
+      on_stack[v] = true;
+      calls.emplace_back(v, starts[v]);
+    }
+
+    void pop_component(size_t root) {
+      size_t size = 0;
+      for(;;) {
+	auto w = stack.back();
+	stack.pop_back();
+	on_stack[w] = false;
+	component[w] = cyclic.size();
+	size++;
+	if(w == root)
+	  break;
+      }
+      cyclic.push_back(size > 1);
+    }
+
+    const std::vector<size_t>& starts;
+    const std::vector<size_t>& edges;
+    std::vector<size_t> order, low;
+    std::vector<bool> on_stack;
+    std::vector<size_t> stack;
+    std::vector<size_t> self_loops;
+    // Nodes being visited, with the next of their edges to follow.
+    std::vector<std::pair<size_t, size_t>> calls;
+    size_t next_order = 0;
+  };
+}
+
+namespace aiproc {
+  void track_heap(State& state) {
+    if(!state.heap)
+      state.heap.reset(new HeapRegistry);
+  }
+
+  HeapCensus take_census(const State& state, const std::vector<Value>& roots) {
+    HeapCensus census;
+    census.tracked = bool(state.heap);
+    Graph graph;
+    if(state.heap) {
+      for(auto pair : state.heap->pairs)
+	graph.add(pair);
+      for(auto env : state.heap->environments)
+	graph.add(env);
+    }
+
+    std::map<std::pair<HeapKind, uint32_t>, SiteCensus> sites;
+    auto tally = [&](HeapKind kind, uint32_t site, uint64_t bytes, bool leaked) {
+      auto& s = sites[std::make_pair(kind, site)];
+      s.kind = kind;
+      s.site = site;
+      s.count++;
+      s.bytes += bytes;
+      census.objects++;
+      census.bytes += bytes;
+      if(leaked) {
+	s.leaked++;
+	s.leaked_bytes += bytes;
+	census.leaked++;
+	census.leaked_bytes += bytes;
+      }
+    };
+    auto tally_closure = [&](const Value& v, bool leaked) {
+      if(v.which() == 1)
+	tally(HeapKind::closure, uint32_t(boost::get<Closure>(v).address), sizeof(Closure), leaked);
+    };
+
+    // Mark everything the roots reach.
+    std::vector<bool> reached;
+    std::vector<size_t> pending;
+    auto reach = [&](size_t id) {
+      if(id == NONE)
+	return;
+      if(id >= reached.size())
+	reached.resize(graph.nodes.size(), false);
+      if(!reached[id]) {
+	reached[id] = true;
+	pending.push_back(id);
+      }
+    };
+    auto reach_value = [&](const Value& v) {
+      tally_closure(v, false);
+      reach(graph.target(v));
+    };
+    for(auto& v : roots)
+      reach_value(v);
+    for(auto& v : state.data_stack)
+      reach_value(v);
+    if(state.environment)
+      reach(graph.add(state.environment.get()));
+    for(size_t i = 0; i < state.frame_count; i++) {
+      if(state.control_stack[i].environment)
+	reach(graph.add(state.control_stack[i].environment.get()));
+    }
+    while(!pending.empty()) {
+      auto id = pending.back();
+      pending.pop_back();
+      graph.each_child(id, reach);
+    }
+
+    // Whatever is left is leaked. Following it may turn up more, which
+    // is leaked too; the loop picks that up as it goes.
+    std::vector<size_t> leaked, starts, edges;
+    for(size_t id = 0; id < graph.nodes.size(); id++) {
+      reached.resize(graph.nodes.size(), false);
+      if(reached[id])
+	continue;
+      leaked.push_back(id);
+      starts.push_back(edges.size());
+      graph.each_child(id, [&](size_t child) { edges.push_back(child); });
+    }
+    starts.push_back(edges.size());
+
+    for(size_t id = 0; id < graph.nodes.size(); id++) {
+      tally(graph.nodes[id].kind, graph.site(id), graph.bytes(id), !reached[id]);
+      graph.each_value(id, [&](const Value& v) { tally_closure(v, !reached[id]); });
+    }
+
+    // Find the cycles among the leaks, in the leaked nodes' own numbering.
+    std::vector<size_t> local(graph.nodes.size(), NONE);
+    for(size_t i = 0; i < leaked.size(); i++)
+      local[leaked[i]] = i;
+    // Leaked objects can refer to live ones, but that can't be part of
+    // a cycle, so drop those references.
+    size_t kept = 0, begin = 0;
+    for(size_t v = 0; v < leaked.size(); v++) {
+      auto end = starts[v + 1];
+      starts[v] = kept;
+      for(auto e = begin; e < end; e++) {
+	if(local[edges[e]] != NONE)
+	  edges[kept++] = local[edges[e]];
+      }
+      begin = end;
+    }
+    starts[leaked.size()] = kept;
+    edges.resize(kept);
+    Components components(starts, edges);
+
+    // A cycle nothing else leaked refers to is what's keeping the rest
+    // alive. Give each one what it reaches that no other has claimed.
+    std::vector<bool> referenced(components.cyclic.size(), false);
+    for(size_t v = 0; v < leaked.size(); v++) {
+      for(auto e = starts[v]; e < starts[v + 1]; e++) {
+	if(components.component[edges[e]] != components.component[v])
+	  referenced[components.component[edges[e]]] = true;
+      }
+    }
+    std::vector<std::vector<size_t>> members(components.cyclic.size());
+    for(size_t v = 0; v < leaked.size(); v++)
+      members[components.component[v]].push_back(v);
+
+    std::map<uint32_t, CycleCensus> cycles;
+    std::vector<bool> claimed(leaked.size(), false);
+    for(size_t c = members.size(); c--; ) {
+      if(!components.cyclic[c] || referenced[c])
+	continue;
+      auto first = members[c].front();
+      for(auto v : members[c]) {
+	if(graph.nodes[leaked[v]].kind == HeapKind::environment) {
+	  first = v;
+	  break;
+	}
+      }
+      auto site = graph.site(leaked[first]);
+      auto& cycle = cycles[site];
+      cycle.site = site;
+      cycle.cycles++;
+
+      for(auto v : members[c]) {
+	claimed[v] = true;
+	pending.push_back(v);
+      }
+      while(!pending.empty()) {
+	auto v = pending.back();
+	pending.pop_back();
+	cycle.retained++;
+	cycle.retained_bytes += graph.bytes(leaked[v]);
+	for(auto e = starts[v]; e < starts[v + 1]; e++) {
+	  if(!claimed[edges[e]]) {
+	    claimed[edges[e]] = true;
+	    pending.push_back(edges[e]);
+	  }
+	}
+      }
+    }
+
+    for(auto& s : sites)
+      census.sites.push_back(s.second);
+    std::stable_sort(census.sites.begin(), census.sites.end(), [](const SiteCensus& a, const SiteCensus& b) {
+	return a.bytes > b.bytes;
+      });
+    for(auto& c : cycles)
+      census.cycles.push_back(c.second);
+    std::stable_sort(census.cycles.begin(), census.cycles.end(), [](const CycleCensus& a, const CycleCensus& b) {
+	return a.retained_bytes > b.retained_bytes;
+      });
+    return census;
+  }
+
+  std::string HeapCensus::to_json(const Program* code) const {
+    auto site = [&](std::ostream& out, uint32_t site, bool op) {
+      if(site == HOST_SITE) {
+	out << "\"site\": \"host\"";
+	return;
+      }
+      out << "\"site\": " << site;
+      if(op && code && site < code->ops.size())
+	out << ", \"op\": \"" << OPCODE_NAMES[size_t(code->ops[site].opcode)] << "\"";
+    };
+
+    std::ostringstream out;
+    out << "{\n  \"tracked\": " << (tracked ? "true" : "false")
+	<< ",\n  \"objects\": " << objects
+	<< ", \"bytes\": " << bytes
+	<< ", \"leaked\": " << leaked
+	<< ", \"leaked_bytes\": " << leaked_bytes << ",\n";
+
+    out << "  \"sites\": [";
+    for(size_t i = 0; i < sites.size(); i++) {
+      auto& s = sites[i];
+      out << (i ? ",\n    " : "\n    ") << "{\"kind\": \"" << kind_name(s.kind) << "\", ";
+      site(out, s.site, s.kind != HeapKind::closure);
+      out << ", \"count\": " << s.count
+	  << ", \"bytes\": " << s.bytes
+	  << ", \"leaked\": " << s.leaked
+	  << ", \"leaked_bytes\": " << s.leaked_bytes << "}";
+    }
+    out << (sites.empty() ? "],\n" : "\n  ],\n");
+
+    out << "  \"cycles\": [";
+    for(size_t i = 0; i < cycles.size(); i++) {
+      auto& c = cycles[i];
+      out << (i ? ",\n    " : "\n    ") << "{";
+      site(out, c.site, true);
+      out << ", \"cycles\": " << c.cycles
+	  << ", \"retained\": " << c.retained
+	  << ", \"retained_bytes\": " << c.retained_bytes << "}";
+    }
+    out << (cycles.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    return out.str();
+  }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "aiproc.hpp"
+
+namespace aiproc {
+  enum class HeapKind : uint8_t { pair, environment, closure };
+
+  // The live objects of one kind from one allocation site. Closures
+  // aren't allocated on their own, so they're counted wherever they're
+  // held and grouped by the address of their code instead.
+  struct SiteCensus {
+    HeapKind kind;
+    uint32_t site;
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    // Of those, the ones the roots can't reach.
+    uint64_t leaked = 0;
+    uint64_t leaked_bytes = 0;
+  };
+
+  // Leaked cycles, grouped by where the first frame in each (or the
+  // first cell, if it has no frames) was allocated. A dum whose frame
+  // ends up holding closures over itself shows up here.
+  struct CycleCensus {
+    uint32_t site;
+    uint64_t cycles = 0;
+    // The objects in the cycles and everything only they keep alive.
+    uint64_t retained = 0;
+    uint64_t retained_bytes = 0;
+  };
+
+  // Sizes are the objects' own storage, leaving out reference counts
+  // and allocator overhead.
+  struct HeapCensus {
+    // Without a registry only what the roots reach can be found, so
+    // nothing shows up as leaked.
+    bool tracked = false;
+    uint64_t objects = 0;
+    uint64_t bytes = 0;
+    uint64_t leaked = 0;
+    uint64_t leaked_bytes = 0;
+    // Most bytes first.
+    std::vector<SiteCensus> sites;
+    // Most bytes retained first.
+    std::vector<CycleCensus> cycles;
+
+    // With code, each site is shown with its instruction.
+    std::string to_json(const Program* code = nullptr) const;
+  };
+
+  // Keep a registry of everything state allocates from now on. Call it
+  // before the State allocates anything a census should account for.
+  void track_heap(State& state);
+
+  // Count what state's heap holds. Its stacks and registers are roots,
+  // along with whatever the host is keeping for it between calls.
+  // Anything restored from an image counts as allocated by the host.
+  HeapCensus take_census(const State& state, const std::vector<Value>& roots);
+}
@@ -0,0 +1,238 @@
+#include "image.hpp"
+
+#include <stdexcept>
+#include <unordered_map>
+
+// Layout, all integers as LEB128 varints:
+//   magic, object count, one kind byte per object,
+//   object bodies in id order, root count, roots.
+// A pair's body is its car and cdr; a frame's is its parent reference,
+// value count and values. References are id+1, with 0 meaning null.
+// Objects are numbered in the order they're first reached from the
+// roots, so neither saving nor loading recurses.
+
+namespace {
+  using namespace aiproc;
+
+  const char MAGIC[] = "LMIMG1";
+  enum Kind : uint8_t { K_PAIR = 0, K_ENV = 1 };
+  enum Tag : uint8_t { T_INT = 0, T_CLOSURE = 1, T_PAIR = 2, T_ENV = 3, T_COUNTER = 4 };
+
+  void put(std::string& out, uint64_t n) {
+    while(n >= 0x80) {
+      out += char((n & 0x7f) | 0x80);
+      n >>= 7;
+    }
+    out += char(n);
+  }
+
+  struct Writer {
+    std::unordered_map<const void*, uint64_t> ids;
+    std::vector<Kind> kinds;
+    std::vector<const void*> objects;
+
+    uint64_t ref(const void* obj, Kind kind) {
+      if(!obj)
+	return 0;
+      auto found = ids.find(obj);
+      if(found != ids.end())
+	return found->second + 1;
+      auto id = objects.size();
+      ids[obj] = id;
+      kinds.push_back(kind);
+      objects.push_back(obj);
+      return id + 1;
+    }
+
+    void value(std::string& out, const Value& v) {
+      switch(v.which()) {
+      case 0: {
+	auto n = boost::get<int32_t>(v);
+	out += char(T_INT);
+	put(out, (uint32_t(n) << 1) ^ uint32_t(n >> 31));
+	break;
+      }
+      case 1: {
+	auto& c = boost::get<Closure>(v);
+	out += char(T_CLOSURE);
+	put(out, ref(c.environ.get(), K_ENV));
+	put(out, c.address);
+	break;
+      }
+      case 2:
+	out += char(T_PAIR);
+	put(out, ref(boost::get<Pair::ptr>(v).get(), K_PAIR));
+	break;
+      case 3:
+	out += char(T_ENV);
+	put(out, ref(boost::get<Environment::ptr>(v).get(), K_ENV));
+	break;
+      case 5:
+	out += char(T_COUNTER);
+	put(out, boost::get<counter>(v));
+	break;
+      default:
+	throw std::runtime_error("Can't save an instruction in an AI image");
+      }
+    }
+  };
+
+  struct Reader {
+    const std::string& in;
+    size_t pos;
+
+    uint8_t byte() {
+      if(pos >= in.size())
+	throw std::runtime_error("Truncated AI image");
+      return in[pos++];
+    }
+
+    uint64_t get() {
+      uint64_t n = 0;
+      for(int shift = 0; shift < 64; shift += 7) {
+	auto b = byte();
+	n |= uint64_t(b & 0x7f) << shift;
+	if(!(b & 0x80))
+	  return n;
+      }
+      throw std::runtime_error("Corrupt AI image");
+    }
+  };
+
+  struct Loader {
+    Reader in;
+    // Closures must point into the code the image is loaded for.
+    size_t code_size;
+    std::vector<Kind> kinds;
+    std::vector<Pair::ptr> pairs;
+    std::vector<Environment::ptr> envs;
+
+    Loader(const std::string& image, size_t pos, size_t code_size)
+      : in{image, pos}, code_size(code_size) {}
+
+    template <typename T>
+    const T& object(const std::vector<T>& table, Kind kind) {
+      static const T none;
+      auto id = in.get();
+      if(!id)
+	return none;
+      if(id > kinds.size() || kinds[id-1] != kind)
+	throw std::runtime_error("Corrupt AI image");
+      return table[id-1];
+    }
+
+    Value value() {
+      switch(in.byte()) {
+      case T_INT: {
+	auto z = uint32_t(in.get());
+	return int32_t((z >> 1) ^ -(z & 1));
+      }
+      case T_CLOSURE: {
+	Closure c;
+	c.environ = object(envs, K_ENV);
+	c.address = in.get();
+	if(c.address >= code_size)
+	  throw std::runtime_error("Corrupt AI image");
+	return c;
+      }
+      case T_PAIR:
+	return object(pairs, K_PAIR);
+      case T_ENV:
+	return object(envs, K_ENV);
+      case T_COUNTER:
+	return counter(in.get());
+      default:
+	throw std::runtime_error("Corrupt AI image");
+      }
+    }
+  };
+}
+
+namespace aiproc {
+  std::string save_image(const std::vector<Value>& roots) {
+    Writer w;
+    std::string root_data;
+    put(root_data, roots.size());
+    for(auto& v : roots)
+      w.value(root_data, v);
+
+    // Objects found while writing a body are appended to the table,
+    // so this walks the graph breadth first.
+    std::string bodies;
+    for(size_t i = 0; i < w.objects.size(); i++) {
+      if(w.kinds[i] == K_PAIR) {
+	auto pair = static_cast<const Pair*>(w.objects[i]);
+	w.value(bodies, pair->car);
+	if(pair->cdr_coded) {
+	  // The next cell of a CDR-coded list. It comes back as an
+	  // ordinary pair.
+	  bodies += char(T_PAIR);
+	  put(bodies, w.ref(pair + 1, K_PAIR));
+	} else {
+	  w.value(bodies, pair->cdr);
+	}
+      } else {
+	auto env = static_cast<const Environment*>(w.objects[i]);
+	put(bodies, w.ref(env->parent.get(), K_ENV));
+	put(bodies, env->values.size());
+	for(auto& v : env->values)
+	  w.value(bodies, v);
+      }
+    }
+
+    std::string image(MAGIC, sizeof(MAGIC) - 1);
+    put(image, w.objects.size());
+    for(auto kind : w.kinds)
+      image += char(kind);
+    return image + bodies + root_data;
+  }
+
+  std::vector<Value> load_image(State* state, const std::string& image) {
+    auto magic = sizeof(MAGIC) - 1;
+    if(image.compare(0, magic, MAGIC) != 0)
+      throw std::runtime_error("Not an AI image");
+
+    Loader l(image, magic, state->code->insns.size());
+    auto count = l.in.get();
+    if(count > image.size())
+      throw std::runtime_error("Corrupt AI image");
+
+    // Allocate every object first so bodies can refer forwards.
+    l.kinds.resize(count);
+    l.pairs.resize(count);
+    l.envs.resize(count);
+    for(size_t i = 0; i < count; i++) {
+      l.kinds[i] = Kind(l.in.byte());
+      if(l.kinds[i] == K_PAIR)
+	l.pairs[i] = Pair::create(state, 0, 0);
+      else if(l.kinds[i] == K_ENV)
+	l.envs[i] = Environment::create(state, std::vector<Value>(), Environment::ptr());
+      else
+	throw std::runtime_error("Corrupt AI image");
+    }
+
+    for(size_t i = 0; i < count; i++) {
+      if(l.kinds[i] == K_PAIR) {
+	l.pairs[i]->car = l.value();
+	l.pairs[i]->cdr = l.value();
+      } else {
+	auto& env = l.envs[i];
+	env->parent = l.object(l.envs, K_ENV);
+	auto size = l.in.get();
+	if(size > image.size())
+	  throw std::runtime_error("Corrupt AI image");
+	env->values.reserve(size);
+	for(size_t j = 0; j < size; j++)
+	  env->values.push_back(l.value());
+      }
+    }
+
+    auto root_count = l.in.get();
+    if(root_count > image.size())
+      throw std::runtime_error("Corrupt AI image");
+    std::vector<Value> roots(root_count);
+    for(auto& v : roots)
+      v = l.value();
+    return roots;
+  }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "aiproc.hpp"
+
+namespace aiproc {
+  // Serialize everything reachable from roots into a compact image.
+  // Sharing and cycles between cells and frames are preserved.
+  std::string save_image(const std::vector<Value>& roots);
+
+  // Rebuild an image's roots on state's heap, so the cells count
+  // against its limit like any others. Throws if the image is damaged,
+  // or has closures pointing past the end of state's code.
+  std::vector<Value> load_image(State* state, const std::string& image);
+}
@@ -0,0 +1,131 @@
+/*
+ * C interface to the lambda-man world, see lambdaworld.h.
+ */
+#include "lambdaworld.h"
+#include "world.hpp"
+#include <cstring>
+#include <exception>
+
+using namespace std;
+using namespace LambdaWorld;
+
+struct lw_program {
+    aiproc::Code code;
+};
+
+struct lw_game {
+    WorldState world;
+    GameStats stats;
+};
+
+static thread_local string last_error;
+
+static size_t copyOut(const string &text, char *buffer, size_t size)
+{
+    if (buffer && size) {
+        size_t n = min(text.size(), size - 1);
+        memcpy(buffer, text.data(), n);
+        buffer[n] = '\0';
+    }
+    return text.size();
+}
+
+static void toResult(const GameResult &from, lw_game_result *to)
+{
+    if (!to) {
+        return;
+    }
+    to->score = from.score;
+    to->lives = from.lives;
+    to->ticks = from.ticks;
+    to->outcome = static_cast<lw_outcome>(from.outcome);
+}
+
+lw_program *lw_program_compile(const char *source, size_t length)
+{
+    try {
+        aiproc::Code code = aiproc::compile(string(source, length));
+        return new lw_program{code};
+    } catch (const exception &e) {
+        last_error = e.what();
+        return nullptr;
+    }
+}
+
+void lw_program_free(lw_program *program)
+{
+    delete program;
+}
+
+lw_game *lw_game_create(const char *map, size_t map_length, const lw_program *lambda_man,
+        const char *const *ghost_sources, const size_t *ghost_lengths, size_t ghost_count, unsigned int flags)
+{
+    if (!lambda_man) {
+        last_error = "No Lambda-Man program given";
+        return nullptr;
+    }
+
+    lw_game *game = new lw_game;
+    try {
+        vector<string> ghost_scripts;
+        for (size_t i = 0; i < ghost_count; ++i) {
+            ghost_scripts.push_back(string(ghost_sources[i], ghost_lengths[i]));
+        }
+        GameOptions options;
+        options.stats = &game->stats;
+        options.track_heap = (flags & LW_TRACK_HEAP) != 0;
+        createWorld(game->world, loadMap(map, map_length), lambda_man->code, ghost_scripts, options);
+        return game;
+    } catch (const exception &e) {
+        last_error = e.what();
+        delete game;
+        return nullptr;
+    }
+}
+
+void lw_game_free(lw_game *game)
+{
+    delete game;
+}
+
+int lw_game_step(lw_game *game, lw_game_result *result)
+{
+    try {
+        toResult(stepWorld(game->world), result);
+        return 0;
+    } catch (const exception &e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+int lw_game_run(lw_game *game, lw_game_result *result)
+{
+    try {
+        GameResult r;
+        do {
+            r = stepWorld(game->world);
+        } while (r.outcome == RUNNING);
+        toResult(r, result);
+        return 0;
+    } catch (const exception &e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+size_t lw_game_stats_json(const lw_game *game, char *buffer, size_t size)
+{
+    return copyOut(game->stats.toJson(), buffer, size);
+}
+
+size_t lw_game_heap_json(const lw_game *game, char *buffer, size_t size)
+{
+    const aiproc::State &lambdaMan = get<LMPROC>(get<WSLAMBDA>(game->world));
+    return copyOut(heapCensus(game->world).to_json(lambdaMan.code.get()), buffer, size);
+}
+
+const char *lw_last_error(void)
+{
+    return last_error.c_str();
+}
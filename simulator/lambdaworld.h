@@ -0,0 +1,91 @@
+/*
+ * C interface to the lambda-man simulator, for driving games from other
+ * languages without spawning the lambda-man executable.
+ *
+ * Functions that can fail return NULL or a negative value and leave a
+ * description in lw_last_error(). Nothing here is shared between games,
+ * so different games may be run on different threads; a program may be
+ * shared by any number of games.
+ */
+#ifndef LAMBDAWORLD_H
+#define LAMBDAWORLD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lw_program lw_program;
+typedef struct lw_game lw_game;
+
+typedef enum {
+    LW_RUNNING = 0,
+    LW_WON = 1,
+    LW_LOST = 2,
+    LW_TIMED_OUT = 3
+} lw_outcome;
+
+typedef struct {
+    uint64_t score;
+    uint32_t lives;
+    uint64_t ticks;
+    lw_outcome outcome;
+} lw_game_result;
+
+/*
+ * Compile a Lambda-Man (GCC) program. The result can be reused by any
+ * number of games, and may be freed while they are still running.
+ */
+lw_program *lw_program_compile(const char *source, size_t length);
+void lw_program_free(lw_program *program);
+
+/*
+ * Flags for lw_game_create. LW_TRACK_HEAP keeps a registry of the game's
+ * Lambda-Man heap, so that lw_game_heap_json can find what has leaked;
+ * it makes allocation slower.
+ */
+#define LW_TRACK_HEAP 1u
+
+/*
+ * Create a game from a map and a compiled Lambda-Man program, and run its
+ * main. Ghost programs are passed as GHC source. flags is 0 or
+ * LW_TRACK_HEAP.
+ */
+lw_game *lw_game_create(const char *map, size_t map_length, const lw_program *lambda_man,
+        const char *const *ghost_sources, const size_t *ghost_lengths, size_t ghost_count,
+        unsigned int flags);
+void lw_game_free(lw_game *game);
+
+/*
+ * Advance the game to the next tick with activity, or run it until it
+ * is over. Both fill in result and return 0, or -1 on error.
+ */
+int lw_game_step(lw_game *game, lw_game_result *result);
+int lw_game_run(lw_game *game, lw_game_result *result);
+
+/*
+ * Copy the game's AI telemetry as JSON into buffer, truncated and
+ * NUL-terminated if it doesn't fit. Returns the full length excluding
+ * the terminator, like snprintf.
+ */
+size_t lw_game_stats_json(const lw_game *game, char *buffer, size_t size);
+
+/*
+ * Copy a census of the game's Lambda-Man heap as JSON into buffer: live
+ * cells, frames and closures by the instruction that made them, and
+ * the cycles keeping leaked ones alive. Sized as for lw_game_stats_json.
+ */
+size_t lw_game_heap_json(const lw_game *game, char *buffer, size_t size);
+
+/*
+ * The last error on the calling thread.
+ */
+const char *lw_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
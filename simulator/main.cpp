@@ -3,57 +3,148 @@
  */
 
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
 #include "world.hpp"
+#include "server.hpp"
+#include "viewer.hpp"
 
 using namespace std;
 using namespace LambdaWorld;
-static const char *world_map = "\
-#######################\n\
-#..........#..........#\n\
-#.###.####.#.####.###.#\n\
-#o###.####.#.####.###o#\n\
-#.....................#\n\
-#.###.#.#######.#.###.#\n\
-#.....#....#....#.....#\n\
-#####.#### # ####.#####\n\
-#   #.#    =    #.#   #\n\
-#####.# ### ### #.#####\n\
-#    .  # === #  .    #\n\
-#####.# ####### #.#####\n\
-#   #.#    %    #.#   #\n\
-#####.# ####### #.#####\n\
-#..........#..........#\n\
-#.###.####.#.####.###.#\n\
-#o..#......\\......#..o#\n\
-###.#.#.#######.#.#.###\n\
-#.....#....#....#.....#\n\
-#.########.#.########.#\n\
-#.....................#\n\
-#######################\n\
-";
-
-static const char *lambda_prog =
-  "LDC 0\n"
-  "LDF 4\n"
-  "CONS\n"
-  "RTN\n"
-  "LDC 0\n"
-  "LDC 1\n"
-  "CONS\n"
-  "RTN\n";
+static string readFile(const char *path)
+{
+    ifstream stream(path);
+    if (!stream) {
+        throw runtime_error(string("Can't read ") + path);
+    }
+    return string((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+}
 
 int main(int argc, char *argv[])
 {
-    // Read files from command-line. Game board, 
-    cout << "Loading files:";
+    // Read files from command-line: lambda-man [options] <map> <program> [ghost...]
+    // examples/ has the classic map and a Lambda-Man that heads right.
+    // --stats <file> writes per-tick AI telemetry as JSON.
+    // --serve answers game requests on stdin/stdout, --socket <path> on a
+    // Unix domain socket; --workers <n> sets how many games run at once.
+    // --images <dir> keeps Lambda-Man's heap after main to reuse next time.
+    // --heap <file> writes a census of Lambda-Man's heap at the end, as JSON.
+    // --view plays the game on the terminal instead of logging it, at no
+    // more than --fps <n> frames a second (30) and --speed <x> times
+    // 1000 ticks a second (1; 0 for as fast as it runs).
+    const char *stats_path = nullptr;
+    const char *heap_path = nullptr;
+    bool viewing = false;
+    unsigned int fps = 30;
+    double speed = 1;
+    const char *socket_path = nullptr;
+    bool serving = false;
+    unsigned int workers = 0;
+    string image_dir;
+    vector<const char *> files;
     for(int i = 1; i < argc; ++i) {
-        cout << " " << argv[i];
+        if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--heap") == 0 && i + 1 < argc) {
+            heap_path = argv[++i];
+        } else if (strcmp(argv[i], "--view") == 0) {
+            viewing = true;
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            fps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serving = true;
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            serving = true;
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--images") == 0 && i + 1 < argc) {
+            image_dir = argv[++i];
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+
+    if (serving) {
+        return serve(socket_path ? socket_path : "", workers, image_dir);
+    }
+
+    if (files.size() < 2) {
+        cerr << "usage: " << argv[0] << " [options] <map> <program> [ghost...]" << endl;
+        return 1;
+    }
+
+    cout << "Loading files:";
+    for (auto file : files) {
+        cout << " " << file;
     }
     cout << endl;
 
+    MapInfo world_map;
+    aiproc::Code lambda_code;
+    vector<string> ghost_scripts;
+    try {
+        world_map = loadMapFile(files[0]);
+        lambda_code = aiproc::compile(readFile(files[1]));
+        for (size_t i = 2; i < files.size(); ++i) {
+            ghost_scripts.push_back(readFile(files[i]));
+        }
+    } catch (const exception &e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
     // Instantiate and run world.
     cout << "Instantiating world..." << endl;
-    runWorld(world_map, lambda_prog, {""});
+    GameStats stats;
+    aiproc::HeapCensus heap;
+    GameOptions options;
+    options.stats = stats_path ? &stats : nullptr;
+    options.heap = heap_path ? &heap : nullptr;
+    options.log = viewing ? nullptr : &cout;
+    options.image_dir = image_dir;
+    GameResult result;
+    try {
+        if (viewing) {
+            WorldState world;
+            createWorld(world, world_map, lambda_code, ghost_scripts, options);
+            result = Viewer(cout, fps, speed).run(world);
+            if (options.heap) {
+                heap = heapCensus(world);
+            }
+        } else {
+            result = runWorld(world_map, lambda_code, ghost_scripts, options);
+        }
+    } catch (const exception &e) {
+        // A program that faults ends the game.
+        cerr << e.what() << endl;
+        return 1;
+    }
+    switch (result.outcome) {
+        case WON:
+            cout << "Lambda-Man Won" << endl;
+            break;
+        case LOST:
+            cout << "Lambda-Man Lost" << endl;
+            break;
+        default:
+            break;
+    }
+    cout << "Game Over" << endl;
+    cout << "Score = " << result.score << endl;
+
+    if (stats_path) {
+        ofstream out(stats_path);
+        out << stats.toJson();
+    }
+    if (heap_path) {
+        ofstream out(heap_path);
+        out << heap.to_json(lambda_code.get());
+    }
     return 0;
 }
 
@@ -0,0 +1,140 @@
+/*
+ * Seeded maze generation, for exercising the simulator on maps of any size.
+ */
+#include "mapgen.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+using namespace LambdaWorld;
+
+static const int XMOVE[4] = {0, 1, 0, -1};
+static const int YMOVE[4] = {-1, 0, 1, 0};
+
+// The proportion of dead ends given a second way out.
+static const double BRAID = 0.75;
+
+// splitmix64, so a seed means the same map with any standard library.
+static uint64_t nextRandom(uint64_t &state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static size_t randomBelow(uint64_t &state, size_t n)
+{
+    return nextRandom(state) % n;
+}
+
+static double randomUnit(uint64_t &state)
+{
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+string LambdaWorld::generateMap(const MapSpec &spec)
+{
+    if (spec.width < 3 || spec.height < 3 || spec.width > 256 || spec.height > 256) {
+        throw runtime_error("Maps must be between 3x3 and 256x256");
+    }
+    if (!(spec.pill_density >= 0 && spec.pill_density <= 1)) {
+        throw runtime_error("Pill density must be between 0 and 1");
+    }
+    uint64_t rng = spec.seed;
+    vector<string> rows(spec.height, string(spec.width, '#'));
+
+    // Rooms sit on odd coordinates, with a wall or a passage between
+    // each pair of neighbours. Carve a spanning tree between them with
+    // a depth-first walk, which gives long winding corridors.
+    int cols = (spec.width - 1) / 2;
+    int lines = (spec.height - 1) / 2;
+    auto square = [&](int x, int y, int dir) -> char& {
+        return rows[2 * y + 1 + YMOVE[dir]][2 * x + 1 + XMOVE[dir]];
+    };
+    auto inside = [&](int x, int y) {
+        return x >= 0 && y >= 0 && x < cols && y < lines;
+    };
+
+    vector<bool> visited(cols * lines, false);
+    vector<int> stack = {0};
+    visited[0] = true;
+    rows[1][1] = ' ';
+    while (!stack.empty()) {
+        int x = stack.back() % cols, y = stack.back() / cols;
+        int options[4], count = 0;
+        for (int dir = 0; dir < 4; ++dir) {
+            int nx = x + XMOVE[dir], ny = y + YMOVE[dir];
+            if (inside(nx, ny) && !visited[ny * cols + nx]) {
+                options[count++] = dir;
+            }
+        }
+        if (count == 0) {
+            stack.pop_back();
+            continue;
+        }
+        int dir = options[randomBelow(rng, count)];
+        int nx = x + XMOVE[dir], ny = y + YMOVE[dir];
+        visited[ny * cols + nx] = true;
+        square(x, y, dir) = ' ';
+        rows[2 * ny + 1][2 * nx + 1] = ' ';
+        stack.push_back(ny * cols + nx);
+    }
+
+    // A tree has nowhere to run to. Knock through most dead ends so the
+    // corridors loop.
+    for (int y = 0; y < lines; ++y) {
+        for (int x = 0; x < cols; ++x) {
+            int walls[4], count = 0, exits = 0;
+            for (int dir = 0; dir < 4; ++dir) {
+                if (square(x, y, dir) == ' ') {
+                    ++exits;
+                } else if (inside(x + XMOVE[dir], y + YMOVE[dir])) {
+                    walls[count++] = dir;
+                }
+            }
+            if (exits == 1 && count > 0 && randomUnit(rng) < BRAID) {
+                square(x, y, walls[randomBelow(rng, count)]) = ' ';
+            }
+        }
+    }
+
+    // Scatter the starts, fruit and pills over the open squares.
+    vector<char*> open;
+    for (auto &row : rows) {
+        for (auto &cell : row) {
+            if (cell == ' ') {
+                open.push_back(&cell);
+            }
+        }
+    }
+    if (open.size() < 2 + spec.ghosts + spec.power_pills) {
+        throw runtime_error("Map is too small for its ghosts and power pills");
+    }
+    for (size_t i = open.size() - 1; i > 0; --i) {
+        swap(open[i], open[randomBelow(rng, i + 1)]);
+    }
+
+    size_t next = 0;
+    *open[next++] = '\\';
+    *open[next++] = '%';
+    for (unsigned int i = 0; i < spec.ghosts; ++i) {
+        *open[next++] = '=';
+    }
+    for (unsigned int i = 0; i < spec.power_pills; ++i) {
+        *open[next++] = 'o';
+    }
+    for (; next < open.size(); ++next) {
+        if (randomUnit(rng) < spec.pill_density) {
+            *open[next] = '.';
+        }
+    }
+
+    string text;
+    for (auto &row : rows) {
+        text += row;
+        text += '\n';
+    }
+    return text;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace LambdaWorld {
+/*
+ * What kind of map to generate. The same spec always gives the same map.
+ */
+struct MapSpec {
+    // Including the outer wall; at most 256 each way. An even side
+    // leaves a double wall along the right or bottom edge.
+    unsigned int width = 23;
+    unsigned int height = 21;
+    // The fraction of open squares, after the starts, fruit and power
+    // pills are placed, that get a pill.
+    double pill_density = 1.0;
+    unsigned int ghosts = 4;
+    unsigned int power_pills = 4;
+    uint64_t seed = 1;
+};
+
+/*
+ * Generate a maze in the text form loadMap reads. Corridors are one
+ * square wide and mostly loop back on themselves, like the contest maps,
+ * and every open square can be reached from every other.
+ */
+std::string generateMap(const MapSpec &spec);
+}
@@ -0,0 +1,453 @@
+/*
+ * Long-lived local simulation server, see server.hpp.
+ */
+#include "server.hpp"
+#include "world.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace LambdaWorld;
+
+static const char *OUTCOMES[] = {"running", "won", "lost", "timed-out"};
+
+namespace {
+// Everything clients have loaded, shared between all of them.
+struct Cache {
+    mutex lock;
+    map<string, aiproc::Code> programs;
+    map<string, ghc::Code> ghosts;
+    map<string, shared_ptr<const MapInfo>> maps;
+};
+
+// One connected client. Lines are written whole, and the session isn't
+// torn down until every game it queued has answered.
+struct Session {
+    explicit Session(int out) : out(out) {}
+
+    void reply(const string &line)
+    {
+        lock_guard<mutex> guard(lock);
+        write(line + "\n");
+    }
+
+    void queued()
+    {
+        lock_guard<mutex> guard(lock);
+        ++pending;
+    }
+
+    void answered(const string &line)
+    {
+        lock_guard<mutex> guard(lock);
+        write(line + "\n");
+        if (--pending == 0) {
+            idle.notify_all();
+        }
+    }
+
+    void wait()
+    {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this] { return pending == 0; });
+    }
+
+private:
+    void write(const string &data)
+    {
+        // A client that hangs up early just stops getting answers.
+        for (size_t done = 0; done < data.size(); ) {
+            ssize_t n = ::write(out, data.data() + done, data.size() - done);
+            if (n <= 0) {
+                return;
+            }
+            done += n;
+        }
+    }
+
+    int out;
+    mutex lock;
+    condition_variable idle;
+    size_t pending = 0;
+};
+
+struct Game {
+    shared_ptr<Session> session;
+    string tag;
+    shared_ptr<const MapInfo> world_map;
+    aiproc::Code lambda;
+    vector<ghc::Code> ghosts;
+};
+
+class WorkerPool {
+public:
+    WorkerPool(unsigned int workers, const GameOptions &options) : options(options)
+    {
+        for (unsigned int i = 0; i < workers; ++i) {
+            threads.push_back(thread([this] { work(); }));
+        }
+    }
+
+    // Finishes everything already queued before returning.
+    ~WorkerPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    void submit(Game game)
+    {
+        game.session->queued();
+        {
+            lock_guard<mutex> guard(lock);
+            queue.push_back(move(game));
+        }
+        ready.notify_one();
+    }
+
+private:
+    void work()
+    {
+        for (;;) {
+            Game game;
+            {
+                unique_lock<mutex> guard(lock);
+                ready.wait(guard, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                game = move(queue.front());
+                queue.pop_front();
+            }
+            game.session->answered(play(game));
+        }
+    }
+
+    string play(const Game &game)
+    {
+        ostringstream line;
+        try {
+            WorldState world;
+            createWorld(world, *game.world_map, game.lambda, game.ghosts, options);
+            GameResult result;
+            do {
+                result = stepWorld(world);
+            } while (result.outcome == RUNNING);
+
+            line << "result " << game.tag << " " << OUTCOMES[result.outcome] << " " << result.score
+                << " " << result.lives << " " << result.ticks;
+        } catch (const exception &e) {
+            line << "error " << game.tag << " " << e.what();
+        }
+        return line.str();
+    }
+
+    GameOptions options;
+    mutex lock;
+    condition_variable ready;
+    deque<Game> queue;
+    bool stopping = false;
+    vector<thread> threads;
+};
+
+// Buffered line reader over a file descriptor.
+class LineReader {
+public:
+    explicit LineReader(int in) : in(in) {}
+
+    bool next(string &line)
+    {
+        for (;;) {
+            size_t eol = buffer.find('\n');
+            if (eol != string::npos) {
+                line = buffer.substr(0, eol);
+                buffer.erase(0, eol + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                return true;
+            }
+
+            char chunk[4096];
+            ssize_t n = read(in, chunk, sizeof(chunk));
+            if (n <= 0) {
+                // Treat a trailing unterminated line as a request too.
+                line.swap(buffer);
+                buffer.clear();
+                return !line.empty();
+            }
+            buffer.append(chunk, n);
+        }
+    }
+
+private:
+    int in;
+    string buffer;
+};
+
+// The connected clients, each handled on a thread of its own that's
+// detached as soon as it starts.
+class Clients {
+public:
+    void add(int client)
+    {
+        lock_guard<mutex> guard(lock);
+        fds.insert(client);
+    }
+
+    // Called by the client's thread once it's done with the client.
+    void remove(int client)
+    {
+        lock_guard<mutex> guard(lock);
+        fds.erase(client);
+        close(client);
+        if (fds.empty()) {
+            idle.notify_all();
+        }
+    }
+
+    // Stop reading requests from every client, so each finishes the
+    // games it has queued and hangs up, and wait for them all.
+    void finish()
+    {
+        unique_lock<mutex> guard(lock);
+        for (int client : fds) {
+            shutdown(client, SHUT_RD);
+        }
+        idle.wait(guard, [this] { return fds.empty(); });
+    }
+
+private:
+    mutex lock;
+    condition_variable idle;
+    set<int> fds;
+};
+
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int)
+{
+    stopRequested = 1;
+}
+}
+
+static string readFile(const string &path)
+{
+    ifstream stream(path);
+    if (!stream) {
+        throw runtime_error("Can't read " + path);
+    }
+    return string((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+}
+
+static void load(Cache &cache, const string &kind, const string &id, const string &path)
+{
+    // Compile and parse outside the lock; only publishing needs it.
+    if (kind == "program") {
+        auto code = aiproc::compile(readFile(path));
+        lock_guard<mutex> guard(cache.lock);
+        cache.programs[id] = code;
+    } else if (kind == "ghost") {
+        auto ghost = ghc::compile(readFile(path));
+        lock_guard<mutex> guard(cache.lock);
+        cache.ghosts[id] = ghost;
+    } else {
+        auto wm = make_shared<const MapInfo>(loadMapFile(path));
+        lock_guard<mutex> guard(cache.lock);
+        cache.maps[id] = wm;
+    }
+}
+
+static Game prepare(Cache &cache, const string &tag, istream &words)
+{
+    Game game;
+    game.tag = tag;
+    string mapId, programId, ghostId;
+    words >> mapId >> programId;
+    if (programId.empty()) {
+        throw runtime_error("usage: run <tag> <map> <program> [ghost...]");
+    }
+
+    lock_guard<mutex> guard(cache.lock);
+    auto wm = cache.maps.find(mapId);
+    if (wm == cache.maps.end()) {
+        throw runtime_error("No map " + mapId);
+    }
+    game.world_map = wm->second;
+
+    auto program = cache.programs.find(programId);
+    if (program == cache.programs.end()) {
+        throw runtime_error("No program " + programId);
+    }
+    game.lambda = program->second;
+
+    while (words >> ghostId) {
+        auto ghost = cache.ghosts.find(ghostId);
+        if (ghost == cache.ghosts.end()) {
+            throw runtime_error("No ghost " + ghostId);
+        }
+        game.ghosts.push_back(ghost->second);
+    }
+    return game;
+}
+
+static void handle(Cache &cache, WorkerPool &pool, int in, int out)
+{
+    auto session = make_shared<Session>(out);
+    LineReader reader(in);
+    string line;
+    while (reader.next(line)) {
+        istringstream words(line);
+        string command;
+        words >> command;
+        if (command.empty()) {
+            continue;
+        } else if (command == "quit") {
+            break;
+        } else if (command == "program" || command == "ghost" || command == "map") {
+            string id, path;
+            words >> id >> path;
+            try {
+                load(cache, command, id, path);
+                session->reply("ok " + id);
+            } catch (const exception &e) {
+                session->reply("error " + id + " " + e.what());
+            }
+        } else if (command == "run") {
+            string tag;
+            words >> tag;
+            try {
+                Game game = prepare(cache, tag, words);
+                game.session = session;
+                pool.submit(move(game));
+            } catch (const exception &e) {
+                session->reply("error " + tag + " " + e.what());
+            }
+        } else {
+            session->reply("error " + command + " Unknown request");
+        }
+    }
+    session->wait();
+}
+
+int LambdaWorld::serve(const string &socket_path, unsigned int workers, const string &image_dir)
+{
+    // Clients that hang up shouldn't take the server with them.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!workers) {
+        workers = max(1u, thread::hardware_concurrency());
+    }
+    GameOptions options;
+    options.image_dir = image_dir;
+    Cache cache;
+
+    if (socket_path.empty()) {
+        WorkerPool pool(workers, options);
+        handle(cache, pool, STDIN_FILENO, STDOUT_FILENO);
+        return 0;
+    }
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long: " << socket_path << endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listener < 0 || ::bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        perror(socket_path.c_str());
+        return 1;
+    }
+
+    // SIGINT or SIGTERM shuts the server down cleanly. They stay blocked
+    // on every thread, the ones started below included, and are only
+    // let through while this one waits for a connection; one that comes
+    // in before then is held until it does. The listener doesn't block,
+    // so a connection that goes away before it's accepted can't leave
+    // the server stuck in accept.
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    sigset_t waiting;
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &waiting);
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGTERM);
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    int status = 0;
+    {
+        WorkerPool pool(workers, options);
+        Clients clients;
+        while (!stopRequested) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(listener, &readable);
+            if (pselect(listener + 1, &readable, nullptr, nullptr, nullptr, &waiting) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("pselect");
+                status = 1;
+                break;
+            }
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR) {
+                    continue;
+                }
+                perror("accept");
+                status = 1;
+                break;
+            }
+            // Some systems pass the listener's O_NONBLOCK on.
+            fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+            clients.add(client);
+            thread([&cache, &pool, &clients, client] {
+                handle(cache, pool, client, client);
+                clients.remove(client);
+            }).detach();
+        }
+        clients.finish();
+    }
+
+    close(listener);
+    unlink(socket_path.c_str());
+    return status;
+}
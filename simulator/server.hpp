@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+namespace LambdaWorld {
+/*
+ * Serve games to local clients until they hang up.
+ *
+ * With an empty socket_path the server talks to a single client over
+ * stdin/stdout; otherwise it listens on a Unix domain socket at that path
+ * and accepts any number of clients until it gets SIGINT or SIGTERM;
+ * then it stops reading requests, finishes the games already queued and
+ * returns 0. Programs and maps loaded by one client are visible to all of
+ * them, and games from every client share a pool of worker threads. If
+ * image_dir isn't empty, Lambda-Man heaps after main are kept there and
+ * reused between games.
+ *
+ * The protocol is line based; each request is one line of
+ * whitespace-separated words:
+ *
+ *   program <id> <path>        compile a Lambda-Man program and keep it
+ *   ghost <id> <path>          compile a ghost program and keep it
+ *   map <id> <path>            parse a map and keep it
+ *   run <tag> <map> <program> [ghost...]
+ *                              queue a game
+ *   quit                       finish queued games and hang up
+ *
+ * program, ghost and map answer "ok <id>" straight away. Games answer
+ * "result <tag> <outcome> <score> <lives> <ticks>" whenever they finish,
+ * which need not be the order they were queued in. Anything that fails
+ * answers "error <id-or-tag> <message>".
+ */
+int serve(const std::string &socket_path, unsigned int workers, const std::string &image_dir = "");
+}
@@ -0,0 +1,146 @@
+/*
+ * Per-tick AI cost accounting for runWorld.
+ */
+#include "telemetry.hpp"
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+using namespace LambdaWorld;
+
+template <typename F>
+static Percentiles percentiles(const vector<TickStats> &ticks, F column)
+{
+    Percentiles p;
+    if (ticks.empty()) {
+        return p;
+    }
+
+    vector<double> values;
+    values.reserve(ticks.size());
+    for (auto &t : ticks) {
+        values.push_back(static_cast<double>(column(t)));
+    }
+    sort(values.begin(), values.end());
+
+    // Nearest-rank: the smallest sample with at least q of the data at or below it.
+    auto rank = [&](double q) {
+        size_t n = static_cast<size_t>(q * values.size() + 0.999999);
+        return values[n ? n - 1 : 0];
+    };
+    p.p50 = rank(0.50);
+    p.p90 = rank(0.90);
+    p.p99 = rank(0.99);
+    p.max = values.back();
+    return p;
+}
+
+static void writeRun(ostream &out, const aiproc::RunStats &run)
+{
+    out << "{\"instructions\": " << run.instructions
+        << ", \"budget\": " << run.budget
+        << ", \"allocations\": " << run.allocations
+        << ", \"peak_cells\": " << run.peak_cells
+        << ", \"nanoseconds\": " << run.nanoseconds << "}";
+}
+
+static void writePercentiles(ostream &out, const char *name, const Percentiles &p)
+{
+    out << "    \"" << name << "\": {\"p50\": " << p.p50
+        << ", \"p90\": " << p.p90
+        << ", \"p99\": " << p.p99
+        << ", \"max\": " << p.max << "}";
+}
+
+void GameStats::record(size_t tick, const aiproc::RunStats &run)
+{
+    ++calls;
+    total.instructions += run.instructions;
+    total.budget += run.budget;
+    total.allocations += run.allocations;
+    total.peak_cells = max(total.peak_cells, run.peak_cells);
+    total.nanoseconds += run.nanoseconds;
+    if (!sampling) {
+        return;
+    }
+
+    if (ticks.empty() || ticks.back().tick != tick) {
+        ticks.push_back(TickStats());
+        ticks.back().tick = tick;
+    }
+
+    TickStats &t = ticks.back();
+    ++t.calls;
+    t.instructions += run.instructions;
+    t.allocations += run.allocations;
+    t.peak_cells = max(t.peak_cells, run.peak_cells);
+    t.nanoseconds += run.nanoseconds;
+    if (run.budget) {
+        t.budget_used = max(t.budget_used, static_cast<double>(run.instructions) / run.budget);
+    }
+}
+
+Percentiles GameStats::instructions() const
+{
+    return percentiles(ticks, [](const TickStats &t) { return t.instructions; });
+}
+
+Percentiles GameStats::allocations() const
+{
+    return percentiles(ticks, [](const TickStats &t) { return t.allocations; });
+}
+
+Percentiles GameStats::peakCells() const
+{
+    return percentiles(ticks, [](const TickStats &t) { return t.peak_cells; });
+}
+
+Percentiles GameStats::nanos() const
+{
+    return percentiles(ticks, [](const TickStats &t) { return t.nanoseconds; });
+}
+
+Percentiles GameStats::budgetUsed() const
+{
+    return percentiles(ticks, [](const TickStats &t) { return t.budget_used; });
+}
+
+string GameStats::toJson() const
+{
+    ostringstream out;
+    out << "{\n  \"init\": ";
+    writeRun(out, init);
+    out << ",\n  \"game\": {\"nanoseconds\": " << nanoseconds
+        << ", \"ai_ticks\": " << ticks.size()
+        << ", \"calls\": " << calls
+        << ", \"instructions\": " << total.instructions
+        << ", \"allocations\": " << total.allocations
+        << ", \"ai_nanoseconds\": " << total.nanoseconds << "},\n";
+
+    out << "  \"percentiles\": {\n";
+    writePercentiles(out, "instructions", instructions());
+    out << ",\n";
+    writePercentiles(out, "allocations", allocations());
+    out << ",\n";
+    writePercentiles(out, "peak_cells", peakCells());
+    out << ",\n";
+    writePercentiles(out, "nanoseconds", nanos());
+    out << ",\n";
+    writePercentiles(out, "budget_used", budgetUsed());
+    out << "\n  },\n";
+
+    out << "  \"ticks\": [";
+    for (size_t i = 0; i < ticks.size(); ++i) {
+        auto &t = ticks[i];
+        out << (i ? ",\n    " : "\n    ")
+            << "{\"tick\": " << t.tick
+            << ", \"calls\": " << t.calls
+            << ", \"instructions\": " << t.instructions
+            << ", \"allocations\": " << t.allocations
+            << ", \"peak_cells\": " << t.peak_cells
+            << ", \"nanoseconds\": " << t.nanoseconds
+            << ", \"budget_used\": " << t.budget_used << "}";
+    }
+    out << (ticks.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    return out.str();
+}
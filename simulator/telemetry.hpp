@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "aiproc.hpp"
+
+namespace LambdaWorld {
+/*
+ * What the AIs cost during one tick in which at least one of them ran.
+ * Instructions, allocations and time are summed over every AI call in the
+ * tick; peak_cells is the largest heap any of them reached.
+ */
+struct TickStats {
+    size_t tick = 0;
+    unsigned int calls = 0;
+    uint64_t instructions = 0;
+    uint64_t allocations = 0;
+    size_t peak_cells = 0;
+    uint64_t nanoseconds = 0;
+    // The largest fraction of its instruction budget any call used.
+    double budget_used = 0;
+};
+
+/*
+ * Nearest-rank percentiles over one column of the per-tick samples.
+ */
+struct Percentiles {
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double max = 0;
+};
+
+/*
+ * Everything runWorld learned about a game's AI cost.
+ */
+struct GameStats {
+    // The Lambda-Man main() call made before the first tick.
+    aiproc::RunStats init;
+    std::vector<TickStats> ticks;
+    // Every call in the game added together, with the largest heap
+    // seen. Kept even when the per-tick samples are turned off.
+    aiproc::RunStats total;
+    uint64_t calls = 0;
+    // Whether to keep a sample per tick. Long games add up to a lot
+    // of them, which matters when measuring the simulator's own memory.
+    bool sampling = true;
+    // Wall time of the whole game, including world mechanics.
+    uint64_t nanoseconds = 0;
+
+    // Fold one AI call into the sample for the given tick.
+    void record(size_t tick, const aiproc::RunStats &run);
+
+    Percentiles instructions() const;
+    Percentiles allocations() const;
+    Percentiles peakCells() const;
+    Percentiles nanos() const;
+    Percentiles budgetUsed() const;
+
+    std::string toJson() const;
+};
+}
@@ -0,0 +1,151 @@
+/*
+ * The Lambda-Man CPU: compiling and running GCC programs.
+ */
+#include <sstream>
+#include <string>
+#include <vector>
+#include "aiproc.hpp"
+#include "check.hpp"
+
+using namespace std;
+using namespace aiproc;
+
+// Run main with no arguments. The result lives on state's heap.
+static Pair::ptr runMain(State &state)
+{
+    Closure main;
+    main.address = 0;
+    return state.run(main, {});
+}
+
+static void compiling()
+{
+    // Blank lines, whatever their line endings, are skipped.
+    State state(compile("LDC 1\r\n\r\n   \nLDC 2\r\n \t\nCONS\nRTN\n"));
+    CHECK(state.code->ops.size() == 4);
+    CHECK(boost::get<int32_t>(runMain(state)->cdr) == 2);
+
+    CHECK_THROWS(compile("LDC 1\nFOO\n"), "Unknown opcode: foo");
+    // Every jump and function has to start on an instruction.
+    CHECK_THROWS(compile("LDF 2\nRTN\n"), "Address out of range: 2");
+    CHECK_THROWS(compile("LDF -1\nRTN\n"), "Address out of range: -1");
+    CHECK_THROWS(compile("LDC 1\nSEL 3 4\nRTN\nJOIN\n"), "Address out of range: 4");
+    CHECK_THROWS(compile("LDC 1\nTSEL 0 9\n"), "Address out of range: 9");
+    CHECK(compile("LDC 1\nSEL 3 4\nRTN\nJOIN\nJOIN\n")->ops.size() == 5);
+
+    // Running past the last instruction faults rather than reading on.
+    State offTheEnd(compile("LDC 1\nLDC 2\n"));
+    CHECK_THROWS(runMain(offTheEnd), "Ran off the end of the program!");
+    State empty(compile(""));
+    CHECK_THROWS(runMain(empty), "Ran off the end of the program!");
+}
+
+static void tailCalls()
+{
+    // f(n, count, f) counts n down by tail calls. f comes in as an
+    // argument rather than through LDF, so no closure holds the frame
+    // and each call takes it over.
+    const int32_t n = 1000000;
+    State loop(compile(
+        "LDC " + to_string(n) + "\nLDC 0\nLDF 8\nLDF 8\nAP 3\nLDC 0\nCONS\nRTN\n"
+        "LD 0 0\nTSEL 10 19\n"
+        "LD 0 0\nLDC 1\nSUB\nLD 0 1\nLDC 1\nADD\nLD 0 2\nLD 0 2\nTAP 3\n"
+        "LD 0 1\nRTN\n"));
+    CHECK(boost::get<int32_t>(runMain(loop)->car) == n);
+    // The same eleven instructions a lap, and no frames pushed.
+    CHECK(loop.stats.instructions == 11 * uint64_t(n) + 12);
+    CHECK(loop.control_stack.size() <= 256);
+
+    // A frame a closure has captured is left alone: each lap hands the
+    // next a closure returning its n, and the last calls it.
+    State captured(compile(
+        "LDC 3\nLDC 0\nLDF 7\nAP 2\nLDC 0\nCONS\nRTN\n"
+        "LD 0 0\nTSEL 9 15\n"
+        "LD 0 0\nLDC 1\nSUB\nLDF 18\nLDF 7\nTAP 2\n"
+        "LD 0 1\nAP 0\nRTN\n"
+        "LD 1 0\nRTN\n"));
+    CHECK(boost::get<int32_t>(runMain(captured)->car) == 1);
+}
+
+// What count CDRs of the argument give, paired with 0. Unfused, each
+// CDR is followed by a jump to the next instruction, so no two are in a
+// row.
+static Pair::ptr cdrs(State &state, const Value &list, int count, bool fused)
+{
+    string source = "LD 0 0\n";
+    for (int i = 0; i < count; ++i) {
+        source += "CDR\n";
+        if (!fused) {
+            int next = 1 + 3 * (i + 1);
+            source += "LDC 1\nTSEL " + to_string(next) + " " + to_string(next) + "\n";
+        }
+    }
+    source += "LDC 0\nCONS\nRTN\n";
+    state.code = compile(source);
+    Closure start;
+    start.address = 0;
+    return state.run(start, {list});
+}
+
+static void cdrChains()
+{
+    State state(compile("RTN\n"));
+    // CDR-coded, consed up, and a tuple ending in a consed list.
+    Value coded = Pair::list(&state, {1, 2, 3, 4, 5, 6});
+    Value consed = 0;
+    for (int32_t i = 6; i > 0; --i) {
+        consed = Pair::create(&state, i, consed);
+    }
+    Value mixed = Pair::tuple(&state, {1, 2, 3, Pair::create(&state, 4, Pair::create(&state, 5, Pair::create(&state, 6, 0)))});
+
+    for (auto &list : {coded, consed, mixed}) {
+        for (int count = 1; count <= 6; ++count) {
+            Value fused = cdrs(state, list, count, true)->car;
+            CHECK(state.stats.instructions == uint64_t(count) + 4);
+            Value plain = cdrs(state, list, count, false)->car;
+            CHECK(fused.which() == plain.which());
+            if (count == 6) {
+                CHECK(boost::get<int32_t>(fused) == 0);
+                CHECK(boost::get<int32_t>(plain) == 0);
+            } else {
+                auto a = boost::get<Pair::ptr>(fused), b = boost::get<Pair::ptr>(plain);
+                CHECK(a.get() == b.get());
+                CHECK(boost::get<int32_t>(a->car) == count + 1);
+            }
+        }
+    }
+
+    // Jumping into the middle of a run takes the rest of it.
+    state.code = compile("LD 0 0\nLDC 1\nTSEL 5 5\nCDR\nCDR\nCDR\nCDR\nLDC 0\nCONS\nRTN\n");
+    Closure start;
+    start.address = 0;
+    auto rest = boost::get<Pair::ptr>(state.run(start, {coded})->car);
+    CHECK(boost::get<int32_t>(rest->car) == 3);
+}
+
+static void debugging()
+{
+    const char *source = "LDC 7\nDEBUG\nLDC -2\nDEBUG\nLDC 1\nLDC 2\nCONS\nRTN\n";
+    ostringstream log;
+    State state(compile(source));
+    state.log = &log;
+    runMain(state);
+    CHECK(log.str() == "Lambda-Man debug 7\nLambda-Man debug -2\n");
+
+    // With nowhere to write, DEBUG writes nothing; stdout may be in use.
+    ostringstream out;
+    streambuf *stdoutBuffer = cout.rdbuf(out.rdbuf());
+    State quiet(compile(source));
+    runMain(quiet);
+    cout.rdbuf(stdoutBuffer);
+    CHECK(out.str().empty());
+}
+
+int main()
+{
+    compiling();
+    tailCalls();
+    cdrChains();
+    debugging();
+    return failures;
+}
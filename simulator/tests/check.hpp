@@ -0,0 +1,35 @@
+#pragma once
+
+#include <exception>
+#include <iostream>
+#include <string>
+
+/*
+ * Just enough for the test programs: each failed check is reported with
+ * where it is, and main returns the number of failures.
+ */
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": failed: " #condition << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+// Check that expression throws, with message containing text.
+#define CHECK_THROWS(expression, text) \
+    do { \
+        std::string message; \
+        try { \
+            expression; \
+        } catch (const std::exception &e) { \
+            message = e.what(); \
+        } \
+        if (message.find(text) == std::string::npos) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #expression " didn't throw \"" << (text) \
+                      << "\"" << (message.empty() ? std::string() : ", got \"" + message + "\"") << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
@@ -0,0 +1,127 @@
+/*
+ * The ghost CPU: assembling, running and its interrupts in a game.
+ */
+#include <sstream>
+#include <vector>
+#include "ghc.hpp"
+#include "world.hpp"
+#include "check.hpp"
+
+using namespace std;
+
+static void noInterrupts(uint8_t, ghc::Machine &)
+{
+}
+
+static void parseErrors()
+{
+    CHECK_THROWS(ghc::compile("mov a,1\nfoo a\n"), "line 2: Unknown opcode: foo");
+    CHECK_THROWS(ghc::compile("inc a,b"), "Wrong number of arguments to inc");
+    CHECK_THROWS(ghc::compile("hlt a"), "Wrong number of arguments to hlt");
+    CHECK_THROWS(ghc::compile("mov a,256"), "Constant out of range: 256");
+    CHECK_THROWS(ghc::compile("mov a,b1"), "Bad argument b1");
+    CHECK_THROWS(ghc::compile("mov 3,a"), "mov can't write to 3");
+    CHECK_THROWS(ghc::compile("add pc,1"), "add can't write to pc");
+    CHECK_THROWS(ghc::compile("jeq a,1,2"), "jeq needs a constant first argument");
+    CHECK_THROWS(ghc::compile("int a"), "int needs a constant first argument");
+
+    // Comments, blank lines and case don't matter.
+    auto code = ghc::compile("; nothing yet\n\n  MOV A, [B] ; load\nHLT\n");
+    CHECK(code->ops.size() == 2);
+    CHECK(code->ops[0].args[1].mode == ghc::Mode::ind);
+
+    string longest;
+    for (int i = 0; i < 256; ++i) {
+        longest += "inc a\n";
+    }
+    CHECK(ghc::compile(longest)->ops.size() == 256);
+    CHECK_THROWS(ghc::compile(longest + "hlt\n"), "limited to 256 instructions");
+}
+
+static void halting()
+{
+    ghc::Machine machine(ghc::compile("inc [0]\nmov a,[0]\nhlt\nmov a,99\n"));
+    CHECK(ghc::run(machine, noInterrupts));
+    CHECK(machine.reg[0] == 1);
+    // Memory and registers carry over to the next run; pc doesn't.
+    CHECK(ghc::run(machine, noInterrupts));
+    CHECK(machine.reg[0] == 2);
+    CHECK(machine.pc == 2);
+
+    // Running off the end or dividing by zero faults, keeping whatever
+    // was done before.
+    ghc::Machine off(ghc::compile("mov b,7\n"));
+    CHECK(!ghc::run(off, noInterrupts));
+    CHECK(off.reg[1] == 7);
+    ghc::Machine zero(ghc::compile("mov b,7\ndiv a,0\nhlt\n"));
+    CHECK(!ghc::run(zero, noInterrupts));
+    CHECK(zero.reg[1] == 7);
+}
+
+static void cycleLimit()
+{
+    // Two instructions a lap, so 512 interrupts before it's cut off.
+    ghc::Machine machine(ghc::compile("int 8\njeq 0,0,0\n"));
+    unsigned int interrupts = 0;
+    CHECK(!ghc::run(machine, [&](uint8_t number, ghc::Machine &) {
+        CHECK(number == 8);
+        ++interrupts;
+    }));
+    CHECK(interrupts == ghc::MAX_CYCLES / 2);
+
+    // Halting on the last allowed cycle still counts: a four-instruction
+    // loop taken 255 times, the HLT and however many MOVs before them.
+    const string loop = "inc a\ninc b\ninc c\njlt 3,a,255\nhlt\n";
+    ghc::Machine justInTime(ghc::compile("mov d,0\nmov d,0\nmov d,0\n" + loop));
+    CHECK(ghc::run(justInTime, noInterrupts));
+    CHECK(justInTime.reg[0] == 255);
+    ghc::Machine tooLate(ghc::compile("mov d,0\nmov d,0\nmov d,0\nmov d,0\n" + loop));
+    CHECK(!ghc::run(tooLate, noInterrupts));
+}
+
+// The square the ghost at (3, 2) asks about with INT 7, plus one, is
+// the direction it goes: a wall sends it right and a pill left.
+static string firstGhostMove(unsigned int x, unsigned int y)
+{
+    const char *map =
+        "#######\n"
+        "#.....#\n"
+        "#..=..#\n"
+        "#.....#\n"
+        "#\\....#\n"
+        "#######\n";
+    ostringstream program;
+    program << "mov a," << x << "\nmov b," << y << "\nint 7\nadd a,1\nint 0\nhlt\n";
+    const char *lambdaMan = "LDC 0\nLDF 4\nCONS\nRTN\nLDC 0\nLDC 3\nCONS\nRTN\n";
+
+    ostringstream log;
+    LambdaWorld::GameOptions options;
+    options.log = &log;
+    LambdaWorld::runWorld(map, lambdaMan, {program.str()}, options);
+    string line;
+    istringstream lines(log.str());
+    while (getline(lines, line)) {
+        if (line.compare(0, 8, "Ghost 0'") == 0) {
+            return line.substr(line.find(' ', 19) + 1);
+        }
+    }
+    return "";
+}
+
+static void mapInterrupt()
+{
+    CHECK(firstGhostMove(1, 1) == "(2, 2)");
+    CHECK(firstGhostMove(0, 1) == "(4, 2)");
+    // Off the map either way reads as wall.
+    CHECK(firstGhostMove(200, 1) == "(4, 2)");
+    CHECK(firstGhostMove(1, 200) == "(4, 2)");
+}
+
+int main()
+{
+    parseErrors();
+    halting();
+    cycleLimit();
+    mapInterrupt();
+    return failures;
+}
@@ -0,0 +1,90 @@
+/*
+ * The heap census: what it counts as live, and what as leaked.
+ */
+#include <string>
+#include <vector>
+#include "heap.hpp"
+#include "world.hpp"
+#include "check.hpp"
+
+using namespace std;
+using namespace LambdaWorld;
+
+static const char *const MAP =
+    "#########\n"
+    "#\\.....=#\n"
+    "#########\n";
+
+static aiproc::HeapCensus census(const string &lambdaMan)
+{
+    aiproc::HeapCensus heap;
+    GameOptions options;
+    options.heap = &heap;
+    runWorld(MAP, lambdaMan, {"mov a,3\nint 0\nhlt\n"}, options);
+    return heap;
+}
+
+// Everything the world keeps for Lambda-Man between calls is a root, so
+// a program that keeps nothing leaks nothing.
+static void noLeaks()
+{
+    auto heap = census("LDC 0\nLDF 4\nCONS\nRTN\nLDC 0\nLDC 1\nCONS\nRTN\n");
+    CHECK(heap.tracked);
+    CHECK(heap.objects > 0);
+    CHECK(heap.leaked == 0);
+    CHECK(heap.leaked_bytes == 0);
+    CHECK(heap.cycles.empty());
+}
+
+// A DUM frame whose slot RAP fills with a closure over the frame itself
+// keeps itself, and main's frame above it, alive once main has returned.
+static void dumCycle()
+{
+    aiproc::State state(aiproc::compile(
+        "DUM 1\nLDF 5\nLDF 7\nRAP 1\nRTN\n"
+        "LDC 0\nRTN\n"
+        "LDC 0\nLDC 0\nCONS\nRTN\n"));
+    aiproc::track_heap(state);
+    aiproc::Closure main;
+    main.address = 0;
+    auto result = state.run(main, {});
+
+    auto heap = aiproc::take_census(state, {result});
+    CHECK(heap.leaked == 3);
+    CHECK(heap.cycles.size() == 1);
+    CHECK(heap.cycles[0].site == 0);
+    CHECK(heap.cycles[0].cycles == 1);
+    CHECK(heap.cycles[0].retained == 2);
+    bool frame = false, mainFrame = false, closure = false;
+    for (auto &site : heap.sites) {
+        if (site.kind == aiproc::HeapKind::environment && site.site == 0) {
+            frame = site.leaked == 1;
+        } else if (site.kind == aiproc::HeapKind::environment && site.site == aiproc::HOST_SITE) {
+            mainFrame = site.leaked == 1;
+        } else if (site.kind == aiproc::HeapKind::closure && site.site == 5) {
+            closure = site.leaked == 1;
+        }
+    }
+    CHECK(frame);
+    CHECK(mainFrame);
+    CHECK(closure);
+    // Besides those three, only the result cell is live.
+    CHECK(heap.objects == 4);
+
+    // Break the cycle, so the frames go. The values are moved out first,
+    // as the DUM frame goes with the closure in them.
+    vector<aiproc::Value> values;
+    for (auto env : state.heap->environments) {
+        if (env->site == 0) {
+            values.swap(env->values);
+            break;
+        }
+    }
+}
+
+int main()
+{
+    noLeaks();
+    dumCycle();
+    return failures;
+}
@@ -0,0 +1,165 @@
+/*
+ * Lambda-Man heap images: saving and loading them, and games reusing
+ * them in place of running main.
+ */
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include "image.hpp"
+#include "world.hpp"
+#include "check.hpp"
+
+using namespace std;
+using namespace aiproc;
+using namespace LambdaWorld;
+
+static void roundTrip()
+{
+    auto code = compile("LDC 0\nRTN\n");
+    State state(code), other(code);
+
+    // A cell two places refer to, a CDR-coded list and a frame holding
+    // a closure over itself.
+    auto shared = Pair::create(&state, 1, 2);
+    Value list = Pair::list(&state, {shared, shared, 3});
+    auto env = Environment::create(&state, {}, nullptr);
+    Closure self;
+    self.environ = env;
+    self.address = 1;
+    env->values.push_back(self);
+
+    string image = save_image({list, self, -7});
+    auto roots = load_image(&other, image);
+    CHECK(roots.size() == 3);
+    CHECK(other.cell_count == 4);
+
+    auto first = boost::get<Pair::ptr>(roots[0]);
+    auto second = boost::get<Pair::ptr>(Pair::tail(first));
+    auto third = boost::get<Pair::ptr>(Pair::tail(second));
+    CHECK(boost::get<Pair::ptr>(first->car) == boost::get<Pair::ptr>(second->car));
+    CHECK(boost::get<int32_t>(boost::get<Pair::ptr>(first->car)->cdr) == 2);
+    CHECK(boost::get<int32_t>(third->car) == 3);
+    CHECK(boost::get<int32_t>(third->cdr) == 0);
+
+    auto closure = boost::get<Closure>(roots[1]);
+    CHECK(closure.address == 1);
+    CHECK(boost::get<Closure>(closure.environ->values[0]).environ == closure.environ);
+    CHECK(boost::get<int32_t>(roots[2]) == -7);
+
+    // Break the cycles, so the frames go.
+    env->values.clear();
+    closure.environ->values.clear();
+}
+
+static void damaged()
+{
+    auto code = compile("LDC 0\nRTN\n");
+    State state(code), other(code);
+    Value list = Pair::list(&state, {1, 2, 3});
+    string image = save_image({list});
+
+    CHECK_THROWS(load_image(&other, image.substr(0, image.size() - 1)), "Truncated AI image");
+    CHECK_THROWS(load_image(&other, "LMIMG0" + image.substr(6)), "Not an AI image");
+    string kinds = image;
+    kinds[7] = 9;
+    CHECK_THROWS(load_image(&other, kinds), "Corrupt AI image");
+
+    // Closures have to point into the code they're loaded for.
+    Closure far;
+    far.address = 2;
+    CHECK_THROWS(load_image(&other, save_image({far})), "Corrupt AI image");
+}
+
+static const char *const MAP =
+    "#######\n"
+    "#\\....#\n"
+    "#######\n";
+
+static const char *const OTHER_MAP =
+    "#######\n"
+    "#\\... #\n"
+    "#######\n";
+
+// main keeps (1, 2) and a closure over its own frame; the step heads
+// the way the first of them says.
+static const char *const LAMBDA_MAN =
+    "LDC 1\nLDC 2\nCONS\nLDF 6\nCONS\nRTN\n"
+    "LD 0 0\nLD 0 0\nCAR\nCONS\nRTN\n";
+
+struct Game {
+    GameResult result;
+    // Whether main ran, rather than the image being restored.
+    bool ranMain;
+};
+
+static Game play(const string &map, const string &program, const string &dir)
+{
+    GameStats stats;
+    GameOptions options;
+    options.stats = &stats;
+    options.image_dir = dir;
+    Game game;
+    game.result = runWorld(map, program, {}, options);
+    game.ranMain = stats.init.instructions > 0;
+    return game;
+}
+
+static vector<string> images(const string &dir)
+{
+    vector<string> names;
+    DIR *d = opendir(dir.c_str());
+    while (dirent *entry = readdir(d)) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(dir + "/" + entry->d_name);
+        }
+    }
+    closedir(d);
+    return names;
+}
+
+static void reuse()
+{
+    char dirTemplate[] = "/tmp/image_test.XXXXXX";
+    string dir = mkdtemp(dirTemplate);
+
+    Game first = play(MAP, LAMBDA_MAN, dir);
+    CHECK(first.ranMain);
+    CHECK(first.result.outcome == WON);
+    CHECK(images(dir).size() == 1);
+    Game again = play(MAP, LAMBDA_MAN, dir);
+    CHECK(!again.ranMain);
+    CHECK(again.result.outcome == WON);
+    CHECK(again.result.score == first.result.score);
+
+    // A damaged image is put back by running main.
+    string path = images(dir)[0];
+    {
+        ofstream truncate(path, ios::binary | ios::trunc);
+        truncate << "LMIMG1";
+    }
+    Game damaged = play(MAP, LAMBDA_MAN, dir);
+    CHECK(damaged.ranMain);
+    CHECK(damaged.result.score == first.result.score);
+    CHECK(!play(MAP, LAMBDA_MAN, dir).ranMain);
+
+    // Images belong to one program on one map.
+    CHECK(play(OTHER_MAP, LAMBDA_MAN, dir).ranMain);
+    CHECK(play(MAP, string(LAMBDA_MAN) + "RTN\n", dir).ranMain);
+    CHECK(images(dir).size() == 3);
+
+    for (auto &image : images(dir)) {
+        unlink(image.c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+int main()
+{
+    roundTrip();
+    damaged();
+    reuse();
+    return failures;
+}
@@ -0,0 +1,95 @@
+/*
+ * The terminal viewer: after the first frame, only changed squares are
+ * drawn again.
+ */
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "viewer.hpp"
+#include "check.hpp"
+
+using namespace std;
+using namespace LambdaWorld;
+
+// Lambda-Man eats the top row from left to right while the ghost runs
+// along its own corridor below, so nothing else on the map can change.
+static const char *const MAP =
+    "#######\n"
+    "#\\....#\n"
+    "#######\n"
+    "#=    #\n"
+    "#######\n";
+static const size_t HEIGHT = 5;
+static const size_t WIDTH = 7;
+
+// Apply what the viewer wrote to a screen, noting each square the
+// cursor was moved to once the first frame is out.
+struct Screen {
+    // Wide enough for the status line.
+    vector<string> rows = vector<string>(HEIGHT + 3, string(64, ' '));
+    vector<pair<size_t, size_t>> moves;
+
+    explicit Screen(const string &output)
+    {
+        bool firstFrame = true;
+        size_t x = 0, y = 0;
+        for (size_t i = 0; i < output.size(); ++i) {
+            if (output[i] != '\x1b') {
+                if (y < rows.size() && x < rows[y].size()) {
+                    rows[y][x] = output[i];
+                }
+                ++x;
+                continue;
+            }
+            size_t end = output.find_first_of("HmJKlh", i + 2);
+            string args = output.substr(i + 2, end - i - 2);
+            if (output[end] == 'H') {
+                size_t semicolon = args.find(';');
+                y = strtoul(args.c_str(), nullptr, 10) - 1;
+                x = strtoul(args.c_str() + semicolon + 1, nullptr, 10) - 1;
+                if (!firstFrame) {
+                    moves.push_back(make_pair(x, y));
+                }
+                // The status line comes last in every frame.
+                if (y == HEIGHT + 1) {
+                    firstFrame = false;
+                }
+            }
+            i = end;
+        }
+    }
+};
+
+int main()
+{
+    WorldState world;
+    createWorld(world, loadMap(MAP), aiproc::compile("LDC 0\nLDF 4\nCONS\nRTN\nLDC 0\nLDC 1\nCONS\nRTN\n"),
+            vector<string>{"mov a,1\nint 0\nhlt\n"});
+    ostringstream out;
+    // A frame after every step.
+    Viewer viewer(out, 1000000, 0);
+    GameResult result = viewer.run(world);
+    CHECK(result.outcome == WON);
+
+    Screen screen(out.str());
+    size_t lambdaManMoves = 0, ghostMoves = 0;
+    for (auto &move : screen.moves) {
+        if (move.second == 1 || move.second == 3) {
+            CHECK(move.first >= 1 && move.first <= 5);
+            (move.second == 1 ? lambdaManMoves : ghostMoves)++;
+        } else {
+            // Only the status line and, at the end, the line below it.
+            CHECK(move.first == 0);
+            CHECK(move.second == HEIGHT + 1 || move.second == HEIGHT + 2);
+        }
+    }
+    // Each of Lambda-Man's four steps redraws the squares left and entered.
+    CHECK(lambdaManMoves == 8);
+    CHECK(ghostMoves >= 8);
+    CHECK(screen.rows[1].compare(0, WIDTH, "#    \\#") == 0);
+    CHECK(screen.rows[2].compare(0, WIDTH, "#######") == 0);
+    CHECK(screen.rows[4].compare(0, WIDTH, "#######") == 0);
+    CHECK(screen.rows[HEIGHT + 1].find("Lambda-Man Won") != string::npos);
+    return failures;
+}
@@ -0,0 +1,123 @@
+/*
+ * Playing games: what the world hands Lambda-Man and what it takes back.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "world.hpp"
+#include "lambdaworld.h"
+#include "check.hpp"
+
+using namespace std;
+using namespace LambdaWorld;
+
+static const char *const MAP =
+    "#######\n"
+    "#\\....#\n"
+    "#######\n";
+
+static void loading()
+{
+    MapInfo info = loadMap("#####\r\n#=.o#\r\n#\\.=#\r\n#####\r\n\r\n");
+    CHECK(info.cells.size() == 4);
+    CHECK(info.cells[1][3] == POWER_PILL);
+    CHECK(info.lambdaMan == Location(1, 2));
+    CHECK(info.ghosts == (vector<Location>{Location(1, 1), Location(3, 2)}));
+    CHECK(info.pills == 2);
+
+    CHECK_THROWS(loadMap(""), "Map is empty");
+    CHECK_THROWS(loadMap("\n\n"), "Map is empty");
+    CHECK_THROWS(loadMap("###\n#.#\n"), "Map has no Lambda-Man");
+    CHECK_THROWS(loadMap("###\n#\\#\n##\n"), "Map line 3: 2 squares wide, but line 1 is 3");
+    CHECK_THROWS(loadMap("###\n\n#\\#\n"), "Map line 2: 0 squares wide, but line 1 is 3");
+    CHECK_THROWS(loadMap("\n#\\#\n"), "Map line 1: empty row");
+    CHECK_THROWS(loadMap("####\n#\\x#\n"), "Map line 2, column 3: unexpected character 'x'");
+    CHECK_THROWS(loadMap("####\n#\\\t#\n"), "Map line 2, column 3: unexpected character 0x09");
+    CHECK_THROWS(loadMap("####\n#\\.#\n#.\\#\n"),
+            "Map line 3, column 3: second Lambda-Man; the first is at line 2, column 2");
+
+    string wide = "\\" + string(256, '#');
+    CHECK_THROWS(loadMap(wide), "Map line 1, column 257: more than 256 columns");
+    CHECK(loadMap(wide.substr(0, 256)).cells[0].size() == 256);
+    string tall = "\\\n";
+    for (int i = 1; i < 256; ++i) {
+        tall += "#\n";
+    }
+    CHECK(loadMap(tall).cells.size() == 256);
+    CHECK_THROWS(loadMap(tall + "#\n"), "Map line 257: more than 256 rows");
+
+    CHECK_THROWS(loadMapFile("/nonexistent/map"), "Can't read /nonexistent/map");
+    // Errors in a file name it.
+    char path[] = "/tmp/world_test.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(write(fd, "###\n#x#\n", 8) == 8);
+    close(fd);
+    CHECK_THROWS(loadMapFile(path), string(path) + ": Map line 2, column 2: unexpected character 'x'");
+    unlink(path);
+}
+
+// A Lambda-Man whose step returns direction, whatever it's given.
+static string goes(int direction)
+{
+    return "LDC 0\nLDF 4\nCONS\nRTN\nLDC 0\nLDC " + to_string(direction) + "\nCONS\nRTN\n";
+}
+
+static void moves()
+{
+    GameResult result = runWorld(MAP, goes(1), {});
+    CHECK(result.outcome == WON);
+    CHECK(result.score == 80);
+
+    // Anything but 0 to 3 ends the game, and only that game.
+    CHECK_THROWS(runWorld(MAP, goes(4), {}), "Lambda-Man moved in direction 4");
+    CHECK_THROWS(runWorld(MAP, goes(-100000000), {}), "Lambda-Man moved in direction -100000000");
+
+    // A program that doesn't compile is NULL, with the reason.
+    CHECK(!lw_program_compile("LDF 9\n", 6));
+    CHECK(string(lw_last_error()) == "Address out of range: 9");
+
+    string source = goes(-1);
+    lw_program *program = lw_program_compile(source.data(), source.size());
+    lw_game *game = lw_game_create(MAP, strlen(MAP), program, nullptr, nullptr, 0, 0);
+    CHECK(game);
+    lw_game_result step;
+    CHECK(lw_game_step(game, &step) == -1);
+    CHECK(string(lw_last_error()) == "Lambda-Man moved in direction -1");
+    lw_game_free(game);
+    lw_program_free(program);
+}
+
+// The step function can read main's arguments on every call, not just
+// the first.
+static void mainFrame()
+{
+    const char *lambdaMan =
+        "LDC 0\nLDF 4\nCONS\nRTN\n"
+        // Heads right, as the world main was given isn't an atom.
+        "LDC 0\nLD 1 0\nATOM\nLDC 1\nADD\nCONS\nRTN\n";
+    GameResult result = runWorld(MAP, lambdaMan, {});
+    CHECK(result.outcome == WON);
+    CHECK(result.score == 80);
+}
+
+// DEBUG goes to the game's log, among the moves.
+static void debugLog()
+{
+    ostringstream log;
+    GameOptions options;
+    options.log = &log;
+    runWorld(MAP, "LDC 0\nLDF 4\nCONS\nRTN\nLDC 42\nDEBUG\nLDC 0\nLDC 1\nCONS\nRTN\n", {}, options);
+    CHECK(log.str().find("Lambda-Man debug 42\nLambda-Man's location[127] (2, 1)\n") != string::npos);
+}
+
+int main()
+{
+    loading();
+    moves();
+    mainFrame();
+    debugLog();
+    return failures;
+}
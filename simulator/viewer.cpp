@@ -0,0 +1,176 @@
+/*
+ * Live terminal view of a game, redrawing only what changed.
+ */
+#include "viewer.hpp"
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+using namespace LambdaWorld;
+
+namespace {
+// What a square shows, with what's on it taking priority over the map.
+enum Appearance { A_WALL, A_EMPTY, A_PILL, A_POWER_PILL, A_FRUIT, A_LAMBDAMAN, A_GHOST, A_FRIGHTENED };
+
+// Colour and character for each appearance.
+const char *const LOOKS[] = {
+    "\x1b[0;34m#", "\x1b[0m ", "\x1b[0;37m.", "\x1b[1;37mo",
+    "\x1b[1;32m%", "\x1b[1;33m\\", "\x1b[1;31m=", "\x1b[1;36m="
+};
+
+// Starting squares and the fruit square are empty on the map itself.
+const Appearance MAP_LOOKS[] = {A_WALL, A_EMPTY, A_PILL, A_POWER_PILL, A_EMPTY, A_EMPTY, A_EMPTY};
+
+Appearance appearance(const WorldState &world, const Location &loc)
+{
+    if (get<LMLOC>(get<WSLAMBDA>(world)) == loc) {
+        return A_LAMBDAMAN;
+    }
+    if (get<WSOCCUPANCY>(world)[loc.second][loc.first] > 0) {
+        // Only visible ghosts are counted; the square looks frightened
+        // unless one of them is standard.
+        for (auto &ghost : get<WSGHOSTS>(world)) {
+            if (get<GSLOC>(ghost) == loc && get<GSVIT>(ghost) == STANDARD) {
+                return A_GHOST;
+            }
+        }
+        return A_FRIGHTENED;
+    }
+    GridCell cell = get<WSMAP>(world)[loc.second][loc.first];
+    if (cell == FRUIT && get<WSFRUIT>(world) > 0) {
+        return A_FRUIT;
+    }
+    return MAP_LOOKS[cell];
+}
+
+void moveTo(string &buffer, size_t x, size_t y)
+{
+    buffer += "\x1b[";
+    buffer += to_string(y + 1);
+    buffer += ';';
+    buffer += to_string(x + 1);
+    buffer += 'H';
+}
+}
+
+Viewer::Viewer(ostream &out, unsigned int fps, double speed)
+    : out(out), frame(chrono::steady_clock::duration(chrono::seconds(1)) / max(fps, 1u)), speed(speed)
+{
+}
+
+GameResult Viewer::run(WorldState &world)
+{
+    const WorldMap &wm = get<WSMAP>(world);
+    fruit.clear();
+    for (size_t y = 0; y < wm.size(); ++y) {
+        for (size_t x = 0; x < wm[y].size(); ++x) {
+            if (wm[y][x] == FRUIT) {
+                fruit.push_back(Location(x, y));
+            }
+        }
+    }
+    fruitShown = get<WSFRUIT>(world) > 0;
+    drawn.assign(wm.size() * wm[0].size(), false);
+    changed.clear();
+    get<WSCHANGED>(world) = &changed;
+
+    buffer += "\x1b[?25l\x1b[2J";
+    drawAll(world);
+    drawStatus(world);
+    flush();
+
+    GameResult result;
+    try {
+        auto started = chrono::steady_clock::now();
+        auto nextFrame = started + frame;
+        do {
+            result = stepWorld(world);
+            if (speed > 0) {
+                chrono::duration<double> due(result.ticks / (TICKS_PER_SECOND * speed));
+                this_thread::sleep_until(started + chrono::duration_cast<chrono::steady_clock::duration>(due));
+            }
+            auto now = chrono::steady_clock::now();
+            if (now >= nextFrame || result.outcome != RUNNING) {
+                drawChanged(world);
+                drawStatus(world);
+                flush();
+                nextFrame = now + frame;
+            }
+        } while (result.outcome == RUNNING);
+    } catch (...) {
+        get<WSCHANGED>(world) = nullptr;
+        out << "\x1b[0m\x1b[?25h" << endl;
+        throw;
+    }
+
+    get<WSCHANGED>(world) = nullptr;
+    moveTo(buffer, 0, wm.size() + 2);
+    buffer += "\x1b[0m\x1b[?25h";
+    flush();
+    return result;
+}
+
+void Viewer::drawAll(const WorldState &world)
+{
+    const WorldMap &wm = get<WSMAP>(world);
+    for (size_t y = 0; y < wm.size(); ++y) {
+        moveTo(buffer, 0, y);
+        for (size_t x = 0; x < wm[y].size(); ++x) {
+            buffer += LOOKS[appearance(world, Location(x, y))];
+        }
+    }
+}
+
+void Viewer::drawChanged(const WorldState &world)
+{
+    bool fruitShowing = get<WSFRUIT>(world) > 0;
+    if (fruitShowing != fruitShown) {
+        changed.insert(changed.end(), fruit.begin(), fruit.end());
+        fruitShown = fruitShowing;
+    }
+
+    // Past a screenful of changes it's cheaper to draw the lot.
+    if (changed.size() >= drawn.size()) {
+        drawAll(world);
+        changed.clear();
+        return;
+    }
+
+    size_t width = get<WSMAP>(world)[0].size();
+    for (auto &loc : changed) {
+        size_t square = loc.second * width + loc.first;
+        if (!drawn[square]) {
+            drawn[square] = true;
+            drawSquare(world, loc);
+        }
+    }
+    for (auto &loc : changed) {
+        drawn[loc.second * width + loc.first] = false;
+    }
+    changed.clear();
+}
+
+void Viewer::drawSquare(const WorldState &world, const Location &loc)
+{
+    moveTo(buffer, loc.first, loc.second);
+    buffer += LOOKS[appearance(world, loc)];
+}
+
+void Viewer::drawStatus(const WorldState &world)
+{
+    static const char *const OUTCOMES[] = {"", "  Lambda-Man Won", "  Lambda-Man Lost", "  Out of time"};
+    const LambdaManStat &lambdaMan = get<WSLAMBDA>(world);
+    moveTo(buffer, 0, get<WSMAP>(world).size() + 1);
+    buffer += "\x1b[0mScore " + to_string(get<LMSCORE>(lambdaMan));
+    buffer += "  Lives " + to_string(get<LMLIVES>(lambdaMan));
+    buffer += "  Tick " + to_string(get<WSUTC>(world));
+    buffer += OUTCOMES[get<WSOUTCOME>(world)];
+    buffer += "\x1b[K";
+}
+
+void Viewer::flush()
+{
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+    buffer.clear();
+}
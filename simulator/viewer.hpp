@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "world.hpp"
+
+namespace LambdaWorld {
+/*
+ * (added) Plays a game on an ANSI terminal. The map is drawn once; after
+ * that only the squares the world notes as changed are drawn again, with
+ * the cursor moved to each, so a frame costs what changed rather than the
+ * size of the map.
+ */
+class Viewer {
+public:
+    // How many game ticks make a second at speed 1.
+    static const unsigned int TICKS_PER_SECOND = 1000;
+
+    // Draw at most fps frames a second. Play speed times as fast as
+    // TICKS_PER_SECOND, or as fast as the game runs if speed is 0; frames
+    // are skipped rather than holding the game up.
+    Viewer(std::ostream &out, unsigned int fps = 30, double speed = 1);
+
+    // Play a world made by createWorld to the end.
+    GameResult run(WorldState &world);
+
+private:
+    void drawAll(const WorldState &world);
+    void drawChanged(const WorldState &world);
+    void drawSquare(const WorldState &world, const Location &loc);
+    void drawStatus(const WorldState &world);
+    void flush();
+
+    std::ostream &out;
+    std::chrono::steady_clock::duration frame;
+    double speed;
+    // Squares noted by the world since the last frame.
+    std::vector<Location> changed;
+    // Which squares are already in the frame being built, row-major.
+    std::vector<bool> drawn;
+    // Where fruit appears, and whether it was showing last frame.
+    std::vector<Location> fruit;
+    bool fruitShown = false;
+    std::string buffer;
+};
+}
@@ -2,10 +2,23 @@
  * Implement the lambda-man world mechanics: http://icfpcontest.org/specification.html#the-lambda-man-game-rules
  */
 #include "world.hpp"
+#include "image.hpp"
 #include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <array>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/algorithm/string.hpp>
-#include <boost/algorithm/string/regex.hpp>
-#include <boost/regex.hpp>
 
 using namespace std;
 using namespace boost;
@@ -16,6 +29,8 @@ using namespace aiproc;
 static const int XMOVE[4] = {0, 1, 0, -1};
 static const int YMOVE[4] = {-1, 0, 1, 0};
 static const int FRIGHT_DURATION = 127*20;
+// Everyone starts out, and starts again, facing down.
+static const Direction START_DIR = DOWN;
 
 static const int FRUIT1_APPEAR = 127*200;
 static const int FRUIT1_EXPIRE = 127*280;
@@ -45,6 +60,14 @@ static unsigned int scoreFruit(WorldState &world)
     }
 }
 
+// Ticks between moves for the ghost with this number.
+static size_t ghostSpeed(size_t index, GhostVit vitality)
+{
+    static const size_t STANDARD_SPEED[4] = {GHOST0, GHOST1, GHOST2, GHOST3};
+    static const size_t FRIGHT_SPEED[4] = {GHOST0_FRIGHT, GHOST1_FRIGHT, GHOST2_FRIGHT, GHOST3_FRIGHT};
+    return vitality == FRIGHT ? FRIGHT_SPEED[index % 4] : STANDARD_SPEED[index % 4];
+}
+
 static unsigned int scoreGhost(unsigned int eaten)
 {
     switch (eaten) {
@@ -59,58 +82,376 @@ static unsigned int scoreGhost(unsigned int eaten)
     }
 }
 
-static string printWorld(WorldState &world)
+// Count a ghost on its square (delta 1), or take it off (delta -1),
+// if it can be seen.
+static void occupy(Occupancy &occupancy, const GhostStat &ghost, int delta)
 {
-    string grid;
-    vector<char> gridCellPrinter = {'#', ' ', '.', 'o', '%', '\\', '='};
-    for (auto &row : get<WSMAP>(world)) {
-        for (auto &cell : row) {
-            grid += gridCellPrinter[(size_t)cell];
+    if (get<GSVIT>(ghost) != INVISIBLE) {
+        const Location &loc = get<GSLOC>(ghost);
+        occupancy[loc.second][loc.first] += delta;
+    }
+}
+
+// Note a square whose drawing may have changed, if anyone's drawing.
+static void changed(WorldState &world, const Location &loc)
+{
+    if (vector<Location> *squares = get<WSCHANGED>(world)) {
+        squares->push_back(loc);
+    }
+}
+
+// Note that a ghost's status has changed since Lambda-Man last saw it.
+static void ghostChanged(WorldState &world, const GhostStat &ghost)
+{
+    EncodedWorld &encoded = get<WSENCODED>(world);
+    size_t index = &ghost - get<WSGHOSTS>(world).data();
+    if (index < encoded.ghostStatus.size()) {
+        encoded.ghostStatus[index] = 0;
+    }
+    encoded.ghosts = 0;
+}
+
+static void setGhostVitality(WorldState &world, GhostStat &ghost, GhostVit vitality)
+{
+    Occupancy &occupancy = get<WSOCCUPANCY>(world);
+    occupy(occupancy, ghost, -1);
+    get<GSVIT>(ghost) = vitality;
+    occupy(occupancy, ghost, 1);
+    changed(world, get<GSLOC>(ghost));
+    ghostChanged(world, ghost);
+}
+
+static void moveGhost(WorldState &world, GhostStat &ghost, const Location &loc)
+{
+    Occupancy &occupancy = get<WSOCCUPANCY>(world);
+    changed(world, get<GSLOC>(ghost));
+    occupy(occupancy, ghost, -1);
+    get<GSLOC>(ghost) = loc;
+    occupy(occupancy, ghost, 1);
+    changed(world, loc);
+    ghostChanged(world, ghost);
+}
+
+// Put a ghost back where and how it started, keeping its vitality.
+static void restartGhost(WorldState &world, GhostStat &ghost)
+{
+    moveGhost(world, ghost, get<GSSTART>(ghost));
+    get<GSDIR>(ghost) = START_DIR;
+}
+
+static Value encodeLocation(aiproc::State *state, const Location &loc)
+{
+    return Pair::create(state, int32_t(loc.first), int32_t(loc.second));
+}
+
+// The cells of a tuple or pair, if nothing but the value given holds any
+// of them.
+static Pair *unshared(const Value &value)
+{
+    if (value.which() != 2) {
+        return nullptr;
+    }
+    const Pair::ptr &pair = boost::get<Pair::ptr>(value);
+    return pair.use_count() == 1 ? pair.get() : nullptr;
+}
+
+// Note that a square of the map has changed since Lambda-Man last saw it.
+static void mapChanged(WorldState &world, size_t y)
+{
+    EncodedWorld &encoded = get<WSENCODED>(world);
+    if (y < encoded.rows.size()) {
+        encoded.rows[y] = 0;
+    }
+    encoded.map = 0;
+}
+
+// The world state as the AIs see it: (map, Lambda-Man, ghosts, fruit).
+// Cells are allocated on Lambda-Man's heap.
+static Value encodeWorld(WorldState &world)
+{
+    LambdaManStat &lambdaMan = get<WSLAMBDA>(world);
+    aiproc::State *state = &get<LMPROC>(lambdaMan);
+
+    WorldMap &wm = get<WSMAP>(world);
+    EncodedWorld &encoded = get<WSENCODED>(world);
+    if (encoded.map.which() == 0) {
+        encoded.rows.resize(wm.size());
+        for (size_t y = 0; y < wm.size(); ++y) {
+            if (encoded.rows[y].which() == 0) {
+                encoded.rows[y] = Pair::list(state, vector<Value>(wm[y].begin(), wm[y].end()));
+            }
         }
+        encoded.map = Pair::list(state, encoded.rows);
+    }
+
+    // Most ghosts are between moves on any given tick.
+    if (encoded.ghosts.which() == 0) {
+        auto &ghosts = get<WSGHOSTS>(world);
+        encoded.ghostStatus.resize(ghosts.size());
+        for (size_t i = 0; i < ghosts.size(); ++i) {
+            if (encoded.ghostStatus[i].which() == 0) {
+                auto &g = ghosts[i];
+                encoded.ghostStatus[i] = Pair::tuple(state, {
+                        int32_t(get<GSVIT>(g)),
+                        encodeLocation(state, get<GSLOC>(g)),
+                        int32_t(get<GSDIR>(g))});
+            }
+        }
+        encoded.ghosts = Pair::list(state, encoded.ghostStatus);
+    }
+
+    // Lambda-Man's status changes almost every call. If the AI kept no
+    // hold on the last world it was handed, refill that in place rather
+    // than allocating a new one and freeing the old.
+    const Location &loc = get<LMLOC>(lambdaMan);
+    Pair *outer = unshared(encoded.world);
+    Pair *status = outer ? unshared(outer[1].car) : nullptr;
+    Pair *location = status ? unshared(status[1].car) : nullptr;
+    if (location) {
+        outer[0].car = encoded.map;
+        outer[2].car = encoded.ghosts;
+        outer[2].cdr = int32_t(get<WSFRUIT>(world));
+        status[0].car = int32_t(get<LMVIT>(lambdaMan));
+        status[2].car = int32_t(get<LMDIR>(lambdaMan));
+        status[3].car = int32_t(get<LMLIVES>(lambdaMan));
+        status[3].cdr = int32_t(get<LMSCORE>(lambdaMan));
+        location->car = int32_t(loc.first);
+        location->cdr = int32_t(loc.second);
+    } else {
+        Value lambdaManStatus = Pair::tuple(state, {
+                int32_t(get<LMVIT>(lambdaMan)),
+                encodeLocation(state, loc),
+                int32_t(get<LMDIR>(lambdaMan)),
+                int32_t(get<LMLIVES>(lambdaMan)),
+                int32_t(get<LMSCORE>(lambdaMan))});
+        encoded.world = Pair::tuple(state, {encoded.map, lambdaManStatus, encoded.ghosts, int32_t(get<WSFRUIT>(world))});
+    }
+    return encoded.world;
+}
+
+static string printWorld(const WorldMap &wm)
+{
+    static const char gridCellPrinter[] = {'#', ' ', '.', 'o', '%', '\\', '='};
+    string grid;
+    grid.reserve(wm.size() * (wm[0].size() + 1));
+    for (auto &row : wm) {
+        size_t start = grid.size();
+        grid.resize(start + row.size());
+        transform(row.begin(), row.end(), grid.begin() + start, [](GridCell cell) { return gridCellPrinter[cell]; });
         grid += '\n';
     }
     trim(grid);
     return grid;
 }
 
-static WorldState process(string world_map, const string &lambda_script, const vector<string> &ghost_scripts)
+static const size_t MAX_MAP_SIDE = 256;
+
+// The square each byte stands for, or -1 if it can't appear in a map.
+static const array<int8_t, 256> CELL_OF = [] {
+    array<int8_t, 256> cells;
+    cells.fill(-1);
+    cells['#'] = WALL;
+    cells[' '] = EMPTY;
+    cells['.'] = PILL;
+    cells['o'] = POWER_PILL;
+    cells['%'] = FRUIT;
+    cells['\\'] = LAMBDAMAN;
+    cells['='] = GHOST;
+    return cells;
+}();
+
+static void mapError(size_t line, size_t column, const string &what)
 {
-    WorldState world;
-    map<char, GridCell> gridCellLookup = {{'#', WALL}, {' ', EMPTY}, {'.', PILL}, {'o', POWER_PILL}, {'%', FRUIT}, {'\\', LAMBDAMAN}, {'=', GHOST}};
+    ostringstream message;
+    message << "Map line " << line;
+    if (column) {
+        message << ", column " << column;
+    }
+    message << ": " << what;
+    throw runtime_error(message.str());
+}
 
-    cout << "Processing map " << endl << world_map << endl;
+MapInfo LambdaWorld::loadMap(const char *text, size_t length)
+{
+    MapInfo info;
+    const char *end = text + length;
+    // A final line end, or a few, doesn't start another row.
+    while (end > text && (end[-1] == '\n' || end[-1] == '\r')) {
+        --end;
+    }
+    if (end == text) {
+        throw runtime_error("Map is empty");
+    }
+
+    bool lambdaMan = false;
+    size_t line = 1;
+    for (const char *p = text; ; ++line) {
+        const char *lineEnd = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+        const char *rowEnd = (lineEnd > p && lineEnd[-1] == '\r') ? lineEnd - 1 : lineEnd;
+        size_t width = rowEnd - p;
+
+        if (info.cells.size() == MAX_MAP_SIDE) {
+            mapError(line, 0, "more than 256 rows");
+        } else if (width > MAX_MAP_SIDE) {
+            mapError(line, MAX_MAP_SIDE + 1, "more than 256 columns");
+        } else if (!info.cells.empty() && width != info.cells[0].size()) {
+            ostringstream what;
+            what << width << " squares wide, but line 1 is " << info.cells[0].size();
+            mapError(line, 0, what.str());
+        } else if (width == 0) {
+            mapError(line, 0, "empty row");
+        }
+
+        size_t y = info.cells.size();
+        info.cells.emplace_back(width);
+        GridCell *row = info.cells.back().data();
+        for (size_t x = 0; x < width; ++x) {
+            unsigned char c = p[x];
+            int8_t cell = CELL_OF[c];
+            if (cell < 0) {
+                ostringstream what;
+                what << "unexpected character ";
+                if (isprint(c)) {
+                    what << "'" << c << "'";
+                } else {
+                    what << "0x" << hex << setw(2) << setfill('0') << unsigned(c);
+                }
+                mapError(line, x + 1, what.str());
+            }
+            row[x] = static_cast<GridCell>(cell);
+            switch (cell) {
+                case PILL:
+                    ++info.pills;
+                    break;
+                case LAMBDAMAN:
+                    if (lambdaMan) {
+                        ostringstream what;
+                        what << "second Lambda-Man; the first is at line " << info.lambdaMan.second + 1
+                             << ", column " << info.lambdaMan.first + 1;
+                        mapError(line, x + 1, what.str());
+                    }
+                    lambdaMan = true;
+                    info.lambdaMan = make_pair(x, y);
+                    break;
+                case GHOST:
+                    info.ghosts.push_back(make_pair(x, y));
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if (lineEnd == end) {
+            break;
+        }
+        p = lineEnd + 1;
+    }
+
+    if (!lambdaMan) {
+        throw runtime_error("Map has no Lambda-Man");
+    }
+    return info;
+}
+
+MapInfo LambdaWorld::loadMap(const string &text)
+{
+    return loadMap(text.data(), text.size());
+}
+
+MapInfo LambdaWorld::loadMapFile(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Can't read " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        close(fd);
+        throw runtime_error("Can't read " + path + ": " + strerror(error));
+    }
+
+    // Maps are read straight out of the page cache rather than copied
+    // into a string first.
+    size_t size = st.st_size;
+    void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    int error = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw runtime_error("Can't read " + path + ": " + strerror(error));
+    }
+
+    try {
+        MapInfo info = loadMap(static_cast<const char *>(data), size);
+        if (data) {
+            munmap(data, size);
+        }
+        return info;
+    } catch (const std::exception &e) {
+        if (data) {
+            munmap(data, size);
+        }
+        throw runtime_error(path + ": " + e.what());
+    }
+}
+
+// Drop every value on Lambda-Man's heap held outside the processor,
+// while the processor is still there to count them going.
+static void releaseHeap(WorldState &world)
+{
+    LambdaManStat &lambdaMan = get<WSLAMBDA>(world);
+    get<WSENCODED>(world) = EncodedWorld();
+    get<LMSTATE>(lambdaMan) = Value();
+    get<LMFUNC>(lambdaMan) = Closure();
+}
+
+WorldState &WorldState::operator=(WorldState &&other)
+{
+    releaseHeap(*this);
+    WorldTuple::operator=(std::move(other));
+    return *this;
+}
+
+WorldState::~WorldState()
+{
+    releaseHeap(*this);
+}
+
+static WorldState process(const MapInfo &world_map, aiproc::Code lambda_code, const vector<ghc::Code> &ghostCode, ostream *log)
+{
+    WorldState world;
+    if (log) {
+        *log << "Processing map " << endl << printWorld(world_map.cells) << endl;
+    }
 
-    // Split map by lines, then into individual characters and transform them to enums.
     WorldMap &wm = get<WSMAP>(world);
-    vector<string> split_strings;
-    trim(world_map);
-    split_regex(split_strings, world_map, boost::regex("[\n\r]"));
-    transform(split_strings.begin(), split_strings.end(), back_inserter(wm),
-            [&](string s) {
-            vector<GridCell> line;
-            transform(s.begin(), s.end(), back_inserter(line),
-                [&](char c) {
-                return gridCellLookup[c];
-                });
-            return line;
-            });
-
-    assert(printWorld(world) == world_map);
+    wm = world_map.cells;
+    get<WSPILLS>(world) = world_map.pills;
 
     // Initialize lambda-man and ghosts.
-    Location lambdaManLoc;
+    Location lambdaManLoc = world_map.lambdaMan;
+    // Ghosts take the programs in turn.
     vector<GhostStat> &ghosts = get<WSGHOSTS>(world);
-    for (size_t i = 0; i < wm.size(); ++i) {
-        auto &row = wm[i];
-        for (size_t j = 0; j < row.size(); ++j) {
-            if (row[j] == LAMBDAMAN) {
-                lambdaManLoc = make_pair(j, i);
-            } else if (row[j] == GHOST) {
-                ghosts.push_back(make_tuple(STANDARD, make_pair(j, i), DOWN, 0, make_pair(j, i)));
-            }
+    for (auto &start : world_map.ghosts) {
+        size_t index = ghosts.size();
+        ghc::Machine machine;
+        if (!ghostCode.empty()) {
+            machine.code = ghostCode[index % ghostCode.size()];
         }
+        ghosts.push_back(make_tuple(STANDARD, start, START_DIR, ghostSpeed(index, STANDARD), start, std::move(machine)));
     }
-    get<WSLAMBDA>(world) = make_tuple(0, lambdaManLoc, DOWN, 3, 0, LM_MOVE, aiproc::compile_program(lambda_script), Value(), Closure(), 0, lambdaManLoc);
+    Occupancy &occupancy = get<WSOCCUPANCY>(world);
+    for (auto &row : wm) {
+        occupancy.emplace_back(row.size(), 0);
+    }
+    for (auto &g : ghosts) {
+        occupy(occupancy, g, 1);
+    }
+    get<WSLAMBDA>(world) = make_tuple(0, lambdaManLoc, START_DIR, 3, 0, LM_MOVE, aiproc::State(lambda_code), Value(), Closure(), 0, lambdaManLoc);
+    get<LMPROC>(get<WSLAMBDA>(world)).log = log;
 
     // Initialize no fruit present.
     get<WSFRUIT>(world) = 0;
@@ -118,11 +459,15 @@ static WorldState process(string world_map, const string &lambda_script, const v
     // Initialize time-out countdown.
     get<WSEOL>(world) = 127 * wm[0].size() * wm.size() * 16;
     get<WSUTC>(world) = 0;
+    get<WSSTATS>(world) = nullptr;
+    get<WSLOG>(world) = log;
+    get<WSOUTCOME>(world) = RUNNING;
+    get<WSCHANGED>(world) = nullptr;
 
     return world;
 }
 
-static bool isLegalMove(Location &loc, Direction &dir, WorldMap &wm)
+static bool isLegalMove(const Location &loc, Direction dir, const WorldMap &wm)
 {
     // Change in x and y based on direction.
     auto newx = loc.first + XMOVE[(size_t)dir];
@@ -131,61 +476,391 @@ static bool isLegalMove(Location &loc, Direction &dir, WorldMap &wm)
     return !(newy >= wm.size() || newx >= wm[0].size() || wm[newy][newx] == WALL);
 }
 
+// Run a ghost's program against the world as it stands, and return the
+// direction it asked for, or its current one if it didn't ask. Only the
+// ghost's own processor and trace are written, so ghosts can be run at
+// the same time as each other and as Lambda-Man.
+static Direction runGhost(const WorldState &world, size_t index, ghc::Machine &machine, string &trace)
+{
+    const WorldMap &wm = get<WSMAP>(world);
+    const vector<GhostStat> &ghosts = get<WSGHOSTS>(world);
+    const Location &lambdaManLoc = get<LMLOC>(get<WSLAMBDA>(world));
+    Direction chosen = get<GSDIR>(ghosts[index]);
+
+    ghc::run(machine, [&](uint8_t number, ghc::Machine &m) {
+        uint8_t &a = m.reg[0], &b = m.reg[1];
+        switch (number) {
+            case 0:
+                if (a < 4) {
+                    chosen = static_cast<Direction>(a);
+                }
+                break;
+            case 1:
+            case 2:
+                // There is only ever one Lambda-Man.
+                a = lambdaManLoc.first;
+                b = lambdaManLoc.second;
+                break;
+            case 3:
+                a = index;
+                break;
+            case 4:
+                if (a < ghosts.size()) {
+                    const Location &start = get<GSSTART>(ghosts[a]);
+                    a = start.first;
+                    b = start.second;
+                }
+                break;
+            case 5:
+                if (a < ghosts.size()) {
+                    const Location &loc = get<GSLOC>(ghosts[a]);
+                    a = loc.first;
+                    b = loc.second;
+                }
+                break;
+            case 6:
+                if (a < ghosts.size()) {
+                    b = get<GSDIR>(ghosts[a]);
+                    a = get<GSVIT>(ghosts[a]);
+                }
+                break;
+            case 7:
+                a = (b < wm.size() && a < wm[b].size()) ? wm[b][a] : WALL;
+                break;
+            case 8: {
+                ostringstream line;
+                line << "Ghost " << index << " trace[" << get<WSUTC>(world) << "] pc " << int(m.pc);
+                for (auto r : m.reg) {
+                    line << " " << int(r);
+                }
+                trace += line.str() + "\n";
+                break;
+            }
+            default:
+                break;
+        }
+    });
+    return chosen;
+}
+
+// Where a ghost actually goes when it asks for a direction: never into
+// a wall, and never back the way it came unless it's in a dead end.
+// Otherwise it carries on as it was, or takes the first way out going
+// up, right, down, left.
+static Direction ghostMove(const WorldMap &wm, const GhostStat &ghost, Direction chosen)
+{
+    const Location &loc = get<GSLOC>(ghost);
+    Direction current = get<GSDIR>(ghost);
+    Direction reverse = static_cast<Direction>((current + 2) % 4);
+    int exits = 0;
+    for (int dir = UP; dir <= LEFT; ++dir) {
+        if (dir != reverse && isLegalMove(loc, static_cast<Direction>(dir), wm)) {
+            ++exits;
+        }
+    }
+    if (exits == 0) {
+        return isLegalMove(loc, reverse, wm) ? reverse : current;
+    }
 
-// Input: a world map, Lambda-Man AI script, N Ghost AI scripts
-void LambdaWorld::runWorld(string world_map, string lambda_script, vector<string> ghost_scripts)
+    auto allowed = [&](Direction dir) {
+        return dir != reverse && isLegalMove(loc, dir, wm);
+    };
+    if (allowed(chosen)) {
+        return chosen;
+    }
+    if (allowed(current)) {
+        return current;
+    }
+    for (int dir = UP; dir <= LEFT; ++dir) {
+        if (allowed(static_cast<Direction>(dir))) {
+            return static_cast<Direction>(dir);
+        }
+    }
+    return current;
+}
+
+// Where the Lambda-Man heap after main is kept for this program and map.
+static string imagePath(const string &dir, const aiproc::Code &code, const WorldMap &wm)
+{
+    uint64_t mapHash = aiproc::hash(nullptr, 0);
+    for (auto &row : wm) {
+        mapHash = aiproc::hash(row.data(), row.size() * sizeof(GridCell), mapHash);
+        mapHash = aiproc::hash("\n", 1, mapHash);
+    }
+
+    ostringstream path;
+    path << dir << "/" << hex << setfill('0') << setw(16) << code->hash << "-" << setw(16) << mapHash << ".img";
+    return path.str();
+}
+
+static bool restoreImage(LambdaManStat &lambdaMan, const string &path)
 {
-    WorldState world = process(world_map, lambda_script, ghost_scripts);
+    ifstream stream(path, ios::binary);
+    if (!stream) {
+        return false;
+    }
+    string image((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+
+    // A damaged image is no worse than a missing one; main will rebuild it.
+    try {
+        auto roots = load_image(&get<LMPROC>(lambdaMan), image);
+        if (roots.size() != 2) {
+            return false;
+        }
+        get<LMSTATE>(lambdaMan) = roots[0];
+        get<LMFUNC>(lambdaMan) = boost::get<Closure>(roots[1]);
+        return true;
+    } catch (const std::exception &) {
+        return false;
+    }
+}
+
+static void saveImage(const LambdaManStat &lambdaMan, const string &path)
+{
+    string image = save_image({get<LMSTATE>(lambdaMan), get<LMFUNC>(lambdaMan)});
+
+    // Write to a private file and rename it into place, so concurrent
+    // games never see half an image.
+    ostringstream tmp;
+    tmp << path << ".tmp-" << this_thread::get_id();
+    {
+        ofstream stream(tmp.str(), ios::binary);
+        stream << image;
+        if (!stream) {
+            return;
+        }
+    }
+    rename(tmp.str().c_str(), path.c_str());
+}
+
+void LambdaWorld::createWorld(WorldState &world, const MapInfo &world_map, aiproc::Code lambda_code,
+        const vector<string> &ghost_scripts, const GameOptions &options)
+{
+    vector<ghc::Code> ghostCode;
+    for (auto &script : ghost_scripts) {
+        ghostCode.push_back(ghc::compile(script));
+    }
+    createWorld(world, world_map, lambda_code, ghostCode, options);
+}
+
+void LambdaWorld::createWorld(WorldState &world, const MapInfo &world_map, aiproc::Code lambda_code,
+        const vector<ghc::Code> &ghost_code, const GameOptions &options)
+{
+    world = process(world_map, lambda_code, ghost_code, options.log);
+    get<WSSTATS>(world) = options.stats;
+    LambdaManStat &lambdaMan = get<WSLAMBDA>(world);
+    if (options.track_heap || options.heap) {
+        aiproc::track_heap(get<LMPROC>(lambdaMan));
+    }
+
+    string image;
+    if (!options.image_dir.empty()) {
+        image = imagePath(options.image_dir, lambda_code, world_map.cells);
+        if (restoreImage(lambdaMan, image)) {
+            return;
+        }
+    }
 
     // setup the main entry point.
     Closure main;
     std::vector<Value> main_args;
-    main_args.push_back(0); // world_state
+    main_args.push_back(encodeWorld(world)); // world_state
     main_args.push_back(0); // UNKNOWN
     main.address = 0;
 
     // Run the main program to get the initial AI state and
     // our tick function
-    auto result = get<LMPROC>(get<WSLAMBDA>(world)).run(main, main_args);
-    get<LMSTATE>(get<WSLAMBDA>(world)) = result->car;
-    get<LMFUNC>(get<WSLAMBDA>(world)) = boost::get<Closure>(result->cdr);
-
-    // Initialize Lambda-Man and ghost AI processors.
-    while (get<WSUTC>(world) < get<WSEOL>(world)) {
-        step(world);
-
-        // Check ending conditions.
-        WorldMap &wm = get<WSMAP>(world);
-        // If all ordinary pills eaten, Lambda-Man wins, game over
-        if (none_of(wm.begin(), wm.end(),
-                    [](vector<GridCell> row) {
-                    return none_of(row.begin(), row.end(),
-                        [](GridCell cell) {
-                        return cell == PILL;
-                        }
-                        );
-                    })) {
-            cout << "Lambda-Man Won" << endl;
-            // All pills eaten, double the score
-            get<LMSCORE>(get<WSLAMBDA>(world)) *= 2;
-            break;
-        }
+    auto result = get<LMPROC>(lambdaMan).run(main, main_args);
+    if (options.stats) {
+        options.stats->init = get<LMPROC>(lambdaMan).stats;
+    }
+    get<LMSTATE>(lambdaMan) = result->car;
+    get<LMFUNC>(lambdaMan) = boost::get<Closure>(Pair::tail(result));
 
+    if (!image.empty()) {
+        saveImage(lambdaMan, image);
+    }
+}
+
+GameResult LambdaWorld::gameResult(const WorldState &world)
+{
+    GameResult result;
+    result.score = get<LMSCORE>(get<WSLAMBDA>(world));
+    result.lives = get<LMLIVES>(get<WSLAMBDA>(world));
+    result.ticks = get<WSUTC>(world);
+    result.outcome = get<WSOUTCOME>(world);
+    return result;
+}
+
+aiproc::HeapCensus LambdaWorld::heapCensus(const WorldState &world)
+{
+    const LambdaManStat &lambdaMan = get<WSLAMBDA>(world);
+    const EncodedWorld &encoded = get<WSENCODED>(world);
+    vector<Value> roots = {get<LMSTATE>(lambdaMan), get<LMFUNC>(lambdaMan), encoded.map, encoded.ghosts, encoded.world};
+    roots.insert(roots.end(), encoded.rows.begin(), encoded.rows.end());
+    roots.insert(roots.end(), encoded.ghostStatus.begin(), encoded.ghostStatus.end());
+    return aiproc::take_census(get<LMPROC>(lambdaMan), roots);
+}
+
+GameResult LambdaWorld::stepWorld(WorldState &world)
+{
+    Outcome &outcome = get<WSOUTCOME>(world);
+    if (outcome != RUNNING) {
+        return gameResult(world);
+    }
+    if (get<WSUTC>(world) >= get<WSEOL>(world)) {
+        outcome = TIMED_OUT;
+        return gameResult(world);
+    }
+
+    step(world);
+
+    // Check ending conditions.
+    // If all ordinary pills eaten, Lambda-Man wins, game over
+    if (get<WSPILLS>(world) == 0) {
+        // All pills eaten, double the score
+        get<LMSCORE>(get<WSLAMBDA>(world)) *= 2;
+        outcome = WON;
+    } else if (get<LMLIVES>(get<WSLAMBDA>(world)) == 0) {
         // If Lambda-Man lives is 0, Lambda-Man loses, game over
-        if (get<LMLIVES>(get<WSLAMBDA>(world)) == 0) {
-            cout << "Lambda-Man Lost" << endl;
-            break;
+        outcome = LOST;
+    } else if (get<WSUTC>(world) >= get<WSEOL>(world)) {
+        outcome = TIMED_OUT;
+    }
+    return gameResult(world);
+}
+
+// Input: a world map, Lambda-Man AI script, N Ghost AI scripts
+GameResult LambdaWorld::runWorld(string world_map, string lambda_script, vector<string> ghost_scripts,
+        const GameOptions &options)
+{
+    return runWorld(loadMap(world_map), aiproc::compile(lambda_script), ghost_scripts, options);
+}
+
+GameResult LambdaWorld::runWorld(const MapInfo &world_map, aiproc::Code lambda_code, const vector<string> &ghost_scripts,
+        const GameOptions &options)
+{
+    auto started = chrono::steady_clock::now();
+    WorldState world;
+    createWorld(world, world_map, lambda_code, ghost_scripts, options);
+
+    GameResult result;
+    do {
+        result = stepWorld(world);
+    } while (result.outcome == RUNNING);
+
+    if (options.heap) {
+        *options.heap = heapCensus(world);
+    }
+    if (options.stats) {
+        options.stats->nanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+    }
+    return result;
+}
+
+// Make the moves due this tick. Every AI that's due decides against the
+// world as it stands at the start of the tick; the moves are then made
+// in order, Lambda-Man first and then the ghosts by number.
+static void makeMoves(WorldState &world, bool lambdaManDue, const vector<size_t> &ghostsDue)
+{
+    WorldMap &wm = get<WSMAP>(world);
+    LambdaManStat &lambdaMan = get<WSLAMBDA>(world);
+    vector<GhostStat> &ghosts = get<WSGHOSTS>(world);
+    Location &lambdaManLoc = get<LMLOC>(lambdaMan);
+    auto &lmStep = get<LMSTEP>(lambdaMan);
+    auto fruitLife = get<WSFRUIT>(world);
+    size_t utc = get<WSUTC>(world);
+
+    Pair::ptr result;
+    if (lambdaManDue) {
+        vector<Value> tick_args;
+        tick_args.push_back(get<LMSTATE>(lambdaMan));
+        tick_args.push_back(encodeWorld(world));
+        result = get<LMPROC>(lambdaMan).run(get<LMFUNC>(lambdaMan), std::move(tick_args));
+    }
+    vector<Direction> ghostMoves(ghostsDue.size());
+    vector<string> traces(ghostsDue.size());
+    for (size_t i = 0; i < ghostsDue.size(); ++i) {
+        ghostMoves[i] = runGhost(world, ghostsDue[i], get<GSPROC>(ghosts[ghostsDue[i]]), traces[i]);
+    }
+
+    if (lambdaManDue) {
+        if (get<WSSTATS>(world)) {
+            get<WSSTATS>(world)->record(utc, get<LMPROC>(lambdaMan).stats);
+        }
+        get<LMSTATE>(lambdaMan) = result->car;
+        int32_t move = boost::get<int32_t>(Pair::tail(result));
+        if (move < UP || move > LEFT) {
+            throw runtime_error("Lambda-Man moved in direction " + to_string(move));
+        }
+        Direction lambdaManDir = static_cast<Direction>(move);
+
+        if (isLegalMove(lambdaManLoc, lambdaManDir, wm)) {
+            // Move Lambda-Man.
+            get<LMDIR>(lambdaMan) = lambdaManDir;
+            changed(world, lambdaManLoc);
+            lambdaManLoc.first += XMOVE[(size_t)lambdaManDir];
+            lambdaManLoc.second += YMOVE[(size_t)lambdaManDir];
+            changed(world, lambdaManLoc);
+            if (ostream *log = get<WSLOG>(world)) {
+                *log << "Lambda-Man's location[" << utc << "] (" << lambdaManLoc.first;
+                *log << ", " << lambdaManLoc.second << ")" << endl;
+            }
+        }
+
+        // Based on the FAQ, movement is determined before fruit appears, so determine speed here.
+        switch (wm[lambdaManLoc.second][lambdaManLoc.first]) {
+            case PILL:
+            case POWER_PILL:
+                lmStep = LM_EATING;
+                break;
+            case FRUIT:
+                if (fruitLife > 0) {
+                    lmStep = LM_EATING;
+                    break;
+                }
+                // Intentional fall-through
+            default:
+                lmStep = LM_MOVE;
+                break;
         }
     }
 
-    cout << "Game Over" << endl;
-    cout << "Score = " << get<LMSCORE>(get<WSLAMBDA>(world)) << endl;
+    for (size_t i = 0; i < ghostsDue.size(); ++i) {
+        size_t index = ghostsDue[i];
+        GhostStat &g = ghosts[index];
+        ostream *log = get<WSLOG>(world);
+        if (log) {
+            *log << traces[i];
+        }
+        Direction dir = ghostMove(wm, g, ghostMoves[i]);
+        const Location &loc = get<GSLOC>(g);
+        if (isLegalMove(loc, dir, wm)) {
+            get<GSDIR>(g) = dir;
+            moveGhost(world, g, Location(loc.first + XMOVE[dir], loc.second + YMOVE[dir]));
+            if (log) {
+                *log << "Ghost " << index << "'s location[" << utc << "] (" << loc.first;
+                *log << ", " << loc.second << ")" << endl;
+            }
+        }
+        get<GSSTEP>(g) = utc + ghostSpeed(index, get<GSVIT>(g));
+    }
 }
 
 void LambdaWorld::step(WorldState &world)
 {
     WorldMap &wm = get<WSMAP>(world);
     LambdaManStat &lambdaMan = get<WSLAMBDA>(world);
+    Occupancy &occupancy = get<WSOCCUPANCY>(world);
+
+    // Ghosts only change when they're next due by moving, and moving
+    // ends the step, so this holds for the whole loop.
+    size_t nextGhost = SIZE_MAX;
+    for (auto &g : get<WSGHOSTS>(world)) {
+        if (get<GSPROC>(g).code) {
+            nextGhost = min(nextGhost, get<GSSTEP>(g));
+        }
+    }
 
     for (bool stop = false; !stop; ) {
 
@@ -196,57 +871,35 @@ void LambdaWorld::step(WorldState &world)
         auto &fruitLife = get<WSFRUIT>(world);
         auto &lmStep = get<LMSTEP>(lambdaMan);
         Location &lambdaManLoc = get<LMLOC>(lambdaMan);
-        if (lmStep == 0) {
-
-            vector<Value> tick_args;
-            tick_args.push_back(get<LMSTATE>(lambdaMan));
-            tick_args.push_back(0); // world state
-            auto result = get<LMPROC>(lambdaMan).run(get<LMFUNC>(lambdaMan), tick_args);
-            get<LMFUNC>(lambdaMan).environ->values.clear(); // clear function args after call.
-            get<LMSTATE>(lambdaMan) = result->car;
-            Direction lambdaManDir = static_cast<Direction>(boost::get<int32_t>(result->cdr));
-
-            if (isLegalMove(lambdaManLoc, lambdaManDir, wm)) {
-                // Move Lambda-Man.
-                lambdaManLoc.first += XMOVE[(size_t)lambdaManDir];
-                lambdaManLoc.second += YMOVE[(size_t)lambdaManDir];
-                cout << "Lambda-Man's location[" << get<WSUTC>(world) << "] (" << lambdaManLoc.first;
-                cout << ", " << lambdaManLoc.second << ")" << endl;
-            }
-            stop = true;
+        vector<GhostStat> &ghosts = get<WSGHOSTS>(world);
 
-            // Based on the FAQ, movement is determined before fruit appears, so determine speed here.
-            switch (wm[lambdaManLoc.second][lambdaManLoc.first]) {
-                case PILL:
-                case POWER_PILL:
-                    lmStep = LM_EATING;
-                    break;
-                case FRUIT:
-                    if (fruitLife > 0) {
-                        lmStep = LM_EATING;
-                        break;
-                    }
-                    // Intentional fall-through
-                default:
-                    lmStep = LM_MOVE;
-                    break;
+        auto &utc = get<WSUTC>(world);
+        bool lambdaManDue = lmStep == 0;
+        vector<size_t> ghostsDue;
+        if (utc == nextGhost) {
+            for (size_t i = 0; i < ghosts.size(); ++i) {
+                if (get<GSPROC>(ghosts[i]).code && get<GSSTEP>(ghosts[i]) == utc) {
+                    ghostsDue.push_back(i);
+                }
             }
         }
-        // TODO: Determine ghost moves.
+
+        if (lambdaManDue || !ghostsDue.empty()) {
+            makeMoves(world, lambdaManDue, ghostsDue);
+            stop = true;
+        }
 
         // Actions (fright mode deactivating, fruit appearing/disappearing)
+        // Ghosts only leave standard mode while it's positive, so they
+        // need putting back only when it runs out.
         auto &lambdaManVitality = get<LMVIT>(lambdaMan);
-        if (lambdaManVitality > 0) {
-            --lambdaManVitality;
-        }
-        if (lambdaManVitality == 0) {
+        if (lambdaManVitality > 0 && --lambdaManVitality == 0) {
             for (auto &g : get<WSGHOSTS>(world)) {
-                get<GSVIT>(g) = STANDARD;
+                setGhostVitality(world, g, STANDARD);
             }
         }
 
         // Enable fruit at correct UTC time
-        auto &utc = get<WSUTC>(world);
         if (fruitLife > 0) {
             --fruitLife;
         } else if (utc >= FRUIT1_APPEAR && utc <= FRUIT1_EXPIRE) {
@@ -264,18 +917,21 @@ void LambdaWorld::step(WorldState &world)
             case PILL:
                 //  If pill, pill eaten and removed from game
                 lambdaMansCell = EMPTY;
+                mapChanged(world, lambdaManLoc.second);
                 score += 10;
+                --get<WSPILLS>(world);
                 break;
             case POWER_PILL:
                 //  If power pill, power pill eaten and removed from game, fright mode activated
                 lambdaMansCell = EMPTY;
+                mapChanged(world, lambdaManLoc.second);
                 score += 50;
                 lambdaManVitality += FRIGHT_DURATION;
                 get<LMEATEN>(lambdaMan) = 0;
 
                 // Set all ghosts to FRIGHT-mode.
                 for (auto &g : get<WSGHOSTS>(world)) {
-                    get<GSVIT>(g) = FRIGHT;
+                    setGhostVitality(world, g, FRIGHT);
                 }
                 break;
             case FRUIT:
@@ -291,28 +947,32 @@ void LambdaWorld::step(WorldState &world)
         }
 
         // If ghost and Lambda-man occupy square
-        //  If fright_mode, Lambda-Man eats ghost; move ghost
+        //  If fright_mode, Lambda-Man eats ghost(s); move ghost(s)
         //  Else, Lambda-Man loses life; move Lambda-Man
-        for (auto &g : get<WSGHOSTS>(world)) {
-            Location &loc = get<GSLOC>(g);
-            if (loc == lambdaManLoc && get<GSVIT>(g) != INVISIBLE) {
-                if (lambdaManVitality > 0) {
-                    assert(get<GSVIT>(g) == FRIGHT);
-                    score += scoreGhost(get<LMEATEN>(lambdaMan));
-                    // Increment number eaten.
-                    ++get<LMEATEN>(lambdaMan);
-                    // TODO: Return ghost to its starting position.
-                    get<GSVIT>(g) = INVISIBLE;
-                    get<GSLOC>(g) = get<GSSTART>(g);
-                } else {
-                    --get<LMLIVES>(lambdaMan);
-                    // Return all entities to starting positions.
-                    get<LMLOC>(lambdaMan) = get<LMSTART>(lambdaMan);
-                    for (auto &gh : get<WSGHOSTS>(world)) {
-                        get<GSLOC>(gh) = get<GSSTART>(gh);
+        if (occupancy[lambdaManLoc.second][lambdaManLoc.first] > 0) {
+            if (lambdaManVitality > 0) {
+                // Eat every visible ghost here, in ghost order, so each
+                // scores the next amount in the sequence.
+                for (auto &g : get<WSGHOSTS>(world)) {
+                    if (get<GSLOC>(g) == lambdaManLoc && get<GSVIT>(g) != INVISIBLE) {
+                        assert(get<GSVIT>(g) == FRIGHT);
+                        score += scoreGhost(get<LMEATEN>(lambdaMan));
+                        // Increment number eaten.
+                        ++get<LMEATEN>(lambdaMan);
+                        setGhostVitality(world, g, INVISIBLE);
+                        restartGhost(world, g);
                     }
                 }
-                break;
+            } else {
+                --get<LMLIVES>(lambdaMan);
+                // Return all entities to starting positions and directions.
+                changed(world, lambdaManLoc);
+                get<LMLOC>(lambdaMan) = get<LMSTART>(lambdaMan);
+                get<LMDIR>(lambdaMan) = START_DIR;
+                changed(world, lambdaManLoc);
+                for (auto &g : get<WSGHOSTS>(world)) {
+                    restartGhost(world, g);
+                }
             }
         }
 
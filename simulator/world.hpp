@@ -2,7 +2,11 @@
 
 #include <tuple>
 #include <vector>
+#include <ostream>
 #include "aiproc.hpp"
+#include "heap.hpp"
+#include "ghc.hpp"
+#include "telemetry.hpp"
 
 namespace LambdaWorld {
 /*
@@ -67,10 +71,13 @@ The status for each ghost is a 3-tuple consisting of
   1. the ghost's vitality
   2. the ghost's current location, as an (x,y) pair
   3. the ghost's current direction
-  4. (added) countdown to next step
+  4. (added) the tick of its next step
+  5. (added) starting location
+  6. (added) the ghost's processor; it has no code, and the ghost stays
+     put, if no ghost programs were given
  */
-enum GSIndex { GSVIT = 0, GSLOC = 1, GSDIR = 2, GSSTEP = 3, GSSTART = 4 };
-using GhostStat = std::tuple<GhostVit, Location, Direction, size_t, Location>;
+enum GSIndex { GSVIT = 0, GSLOC = 1, GSDIR = 2, GSSTEP = 3, GSSTART = 4, GSPROC = 5 };
+using GhostStat = std::tuple<GhostVit, Location, Direction, size_t, Location, ghc::Machine>;
 
 /*
 The status of the fruit is a number which is a countdown to the expiry of
@@ -79,17 +86,153 @@ the current fruit, if any.
   * n > 0: fruit present: the number of game ticks remaining while the
            fruit will will be present.
  */
-enum WSIndex { WSMAP = 0, WSLAMBDA = 1, WSGHOSTS = 2, WSFRUIT = 3, WSEOL = 4, WSUTC = 5 };
-using WorldState = std::tuple<WorldMap, LambdaManStat, std::vector<GhostStat>, unsigned int, size_t, size_t>;
+enum Outcome { RUNNING = 0, WON = 1, LOST = 2, TIMED_OUT = 3 };
+
+/*
+ * (added) The number of visible ghosts on each square, row-major like
+ * the map. It follows every change to a ghost's location or vitality,
+ * so a collision with Lambda-Man is one lookup however many ghosts
+ * there are.
+ */
+using Occupancy = std::vector<std::vector<unsigned short>>;
+
+/*
+ * (added) What Lambda-Man was last handed, so the parts of the world
+ * that haven't changed since are handed over again rather than rebuilt:
+ *  - a list per map row, 0 once the row has changed, and the list of
+ *    rows, 0 once any has. Rows are CDR-coded lists, so indexing into
+ *    one doesn't chase pointers;
+ *  - each ghost's status, 0 once it has changed, and the list of them,
+ *    0 once any has;
+ *  - the whole world tuple, refilled in place next time if Lambda-Man
+ *    didn't keep it.
+ */
+struct EncodedWorld {
+    std::vector<aiproc::Value> rows;
+    aiproc::Value map;
+    std::vector<aiproc::Value> ghostStatus;
+    aiproc::Value ghosts;
+    aiproc::Value world;
+};
+
+/*
+ * (added) Bookkeeping that isn't part of the spec's world state:
+ *  - where to record AI telemetry (may be null);
+ *  - where to write the move-by-move log (may be null);
+ *  - how the game ended, if it has;
+ *  - where the visible ghosts are;
+ *  - how many ordinary pills are left to eat;
+ *  - the world as Lambda-Man last saw it;
+ *  - where to note each square Lambda-Man or a ghost leaves or enters,
+ *    or a ghost changes vitality on, for whoever is drawing the game
+ *    (may be null). Squares may be noted more than once. Eaten pills
+ *    are on Lambda-Man's square, and fruit coming and going isn't
+ *    noted.
+ */
+enum WSIndex { WSMAP = 0, WSLAMBDA = 1, WSGHOSTS = 2, WSFRUIT = 3, WSEOL = 4, WSUTC = 5, WSSTATS = 6, WSLOG = 7, WSOUTCOME = 8, WSOCCUPANCY = 9, WSPILLS = 10, WSENCODED = 11, WSCHANGED = 12 };
+using WorldTuple = std::tuple<WorldMap, LambdaManStat, std::vector<GhostStat>, unsigned int, size_t, size_t, GameStats*, std::ostream*, Outcome, Occupancy, size_t, EncodedWorld, std::vector<Location>*>;
+
+/*
+ * (added) The world state. Tuple elements are destroyed first to last,
+ * which would leave Lambda-Man's AI state and the encoded world freeing
+ * cells back into a processor that has already gone, so the destructor,
+ * and assigning over a world, let go of them first.
+ */
+struct WorldState : WorldTuple {
+    WorldState() = default;
+    WorldState(WorldState &&) = default;
+    WorldState &operator=(WorldState &&);
+    ~WorldState();
+};
+
+/*
+ * The result of a game, or of the game so far if outcome is RUNNING.
+ */
+struct GameResult {
+    size_t score = 0;
+    unsigned int lives = 0;
+    size_t ticks = 0;
+    Outcome outcome = RUNNING;
+};
+
+/*
+ * Optional extras for a game.
+ */
+struct GameOptions {
+    // Where to record the cost of every AI call.
+    GameStats *stats = nullptr;
+    // Where to write the move-by-move log.
+    std::ostream *log = nullptr;
+    // Directory of Lambda-Man heaps saved after main, keyed by program
+    // and map, so repeated games skip main. Empty to always run it.
+    std::string image_dir;
+    // Have createWorld keep a registry of Lambda-Man's heap, so that a
+    // census can find leaks. Slows allocation down.
+    bool track_heap = false;
+    // Where runWorld puts a census of Lambda-Man's heap as the game
+    // ends. Setting it turns on track_heap.
+    aiproc::HeapCensus *heap = nullptr;
+};
+
+/*
+ * (added) A map as loaded, with what a world needs to know about it
+ * found in the same pass.
+ */
+struct MapInfo {
+    WorldMap cells;
+    Location lambdaMan;
+    // Ghost starting positions, in ghost number order.
+    std::vector<Location> ghosts;
+    size_t pills = 0;
+};
+
+/*
+ * Load a map from its text form. Throws if it isn't rectangular, is
+ * larger than 256x256, contains anything but map characters, or doesn't
+ * have exactly one Lambda-Man, naming the line and column at fault.
+ */
+MapInfo loadMap(const char *text, size_t length);
+MapInfo loadMap(const std::string &text);
+MapInfo loadMapFile(const std::string &path);
+
+/*
+ * Set up a world from a map and compiled Lambda-Man code, and run
+ * Lambda-Man's main (or restore its saved result) to get its initial
+ * AI state. Ghosts take the ghost programs in turn; with none, they
+ * stay put.
+ *
+ * The AI heap points back at the processor in the world, so the world
+ * must not be moved or copied once this returns.
+ */
+void createWorld(WorldState &world, const MapInfo &world_map, aiproc::Code lambda_code,
+        const std::vector<ghc::Code> &ghost_code, const GameOptions &options = GameOptions());
+void createWorld(WorldState &world, const MapInfo &world_map, aiproc::Code lambda_code,
+        const std::vector<std::string> &ghost_scripts, const GameOptions &options = GameOptions());
 
 /*
  * Advance the world state to the next tick with activity.
  */
 void step(WorldState&);
 
+/*
+ * Step the world once and check the ending conditions.
+ * Does nothing once the game is over.
+ */
+GameResult stepWorld(WorldState&);
+
+GameResult gameResult(const WorldState&);
+
+/*
+ * (added) Count what Lambda-Man's heap holds between ticks.
+ */
+aiproc::HeapCensus heapCensus(const WorldState&);
+
 /*
  * Execute the world until Lambda-Man wins, loses, or runs out of time.
  */
-void runWorld(std::string world_map, std::string lambda_script, std::vector<std::string> ghost_scripts);
+GameResult runWorld(const MapInfo &world_map, aiproc::Code lambda_code, const std::vector<std::string> &ghost_scripts,
+        const GameOptions &options = GameOptions());
+GameResult runWorld(std::string world_map, std::string lambda_script, std::vector<std::string> ghost_scripts,
+        const GameOptions &options = GameOptions());
 }
 